@@ -2,6 +2,8 @@
 #define PWRTRAY_API_H_
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
 #include <netinet/in.h>
 
 #ifdef __cplusplus
@@ -10,6 +12,7 @@ extern "C" {
 
 #define PT_SOCK_DIR	"/var/run/pwrtray"
 #define PT_SOCKET	PT_SOCK_DIR "/socket"
+#define PT_SOCKET_V2	PT_SOCK_DIR "/socket2"
 
 //#define PT_PACKED	__attribute__((__packed__))
 #define PT_PACKED
@@ -18,11 +21,17 @@ enum {
 	PTREQ_PING			= 0x0,
 	PTREQ_WANT_NOTIFY,
 	PTREQ_XEVREP,
+	PTREQ_HELLO,			/* Protocol v2 version negotiation */
+	PTREQ_STATE_PAGE,		/* Get the state page fd (SCM_RIGHTS) */
+	PTREQ_EVENT_RING,		/* Get the event ring fd (SCM_RIGHTS) */
+	PTREQ_SESSION,			/* Session setup with state snapshot */
+	PTREQ_GET_IF_CHANGED,		/* Get the state, if the generation changed */
 
 	/* Backlight controls */
 	PTREQ_BL_GETSTATE		= 0x100,
 	PTREQ_BL_SETBRIGHTNESS,
 	PTREQ_BL_AUTODIM,
+	PTREQ_BL_AUTODIM_GETSTATE,
 
 	/* Battery controls */
 	PTREQ_BAT_GETSTATE		= 0x200,
@@ -47,6 +56,42 @@ enum {
 #define PT_AUTODIM_FLG_ENABLE		(1 << 0) /* Auto dimming enable */
 #define PT_AUTODIM_FLG_ENABLE_AC	(1 << 1) /* Auto dimming enable on AC */
 
+/* (struct pt_message *)->autodim_stat.flags */
+#define PT_AUTODIM_STAT_ENABLED		(1 << 0) /* Auto dimming enabled */
+#define PT_AUTODIM_STAT_ENABLED_AC	(1 << 1) /* Auto dimming enabled on AC */
+#define PT_AUTODIM_STAT_SUSPENDED	(1 << 2) /* Auto dimming suspended */
+
+/* (struct pt_message *)->session.flags
+ * The reply to PTREQ_SESSION is preceded by the replies to
+ * PTREQ_BL_GETSTATE, PTREQ_BAT_GETSTATE and PTREQ_BL_AUTODIM_GETSTATE.
+ * All are taken atomically and carry the tag of the session request. */
+#define PT_SESSION_FLG_NOTIFY		(1 << 0) /* Enable notifications */
+#define PT_SESSION_FLG_XEVREP		(1 << 1) /* Enable X11 input reporting */
+
+/* (struct pt_message *)->generation.changed
+ * The request carries the generations known to the client.
+ * The reply carries the current generations and the mask of the states
+ * that changed. The reply is preceded by the state replies
+ * (see PT_SESSION_FLG_*) of the changed states. A changed mask of 0
+ * means that the client is up to date. Generation 0 is never used. */
+#define PT_GEN_BL			(1 << 0) /* Backlight state */
+#define PT_GEN_BAT			(1 << 1) /* Battery state */
+#define PT_GEN_AUTODIM			(1 << 2) /* Autodim state */
+
+/* (struct pt_message *)->notify.mask
+ * A mask of 0 selects all notifications. PTNOTI_SRVDOWN is always sent. */
+#define PT_NOTIFY_BL			(1 << 0) /* PTNOTI_BL_CHANGED */
+#define PT_NOTIFY_BAT			(1 << 1) /* PTNOTI_BAT_CHANGED */
+
+/* (struct pt_message *)->notify.predicates
+ * Only send a notification, if any of the selected fields changed
+ * since the last notification sent to this client. */
+#define PT_NOTIFY_PRED_BL_FLAGS		(1 << 0) /* Backlight autodim flags */
+#define PT_NOTIFY_PRED_BL_BRIGHTNESS	(1 << 1) /* Backlight brightness */
+#define PT_NOTIFY_PRED_BAT_ONAC		(1 << 8) /* AC state flips */
+#define PT_NOTIFY_PRED_BAT_CHARGING	(1 << 9) /* Charging state flips */
+#define PT_NOTIFY_PRED_BAT_PERCENT	(1 << 10) /* Battery percent */
+
 /* (struct pt_message *)->flags */
 #define PT_FLG_REPLY			(1 << 0) /* This is a reply to a previous message */
 #define PT_FLG_OK			(1 << 1) /* There was no error */
@@ -76,12 +121,284 @@ struct pt_message {
 			int32_t max_level;
 			int32_t level;
 		} PT_PACKED bat_stat;
+		struct { /* Autodim state */
+			uint32_t flags;
+			int32_t max_percent;
+			int32_t percent;	/* Current brightness */
+			uint32_t step;		/* Current dim step */
+			uint32_t nr_steps;
+		} PT_PACKED autodim_stat;
+		struct { /* Session setup */
+			uint32_t flags;
+			uint32_t notify_mask;		/* See notify.mask */
+			uint32_t notify_predicates;	/* See notify.predicates */
+		} PT_PACKED session;
+		struct { /* State generations */
+			uint32_t changed;	/* Only for PT_FLG_REPLY */
+			uint32_t bl;
+			uint32_t bat;
+			uint32_t autodim;
+		} PT_PACKED generation;
+		struct { /* Notification subscription */
+			uint32_t mask;
+			uint32_t predicates;
+		} PT_PACKED notify;
+		struct { /* Protocol version negotiation */
+			uint32_t version;
+		} PT_PACKED hello;
 		struct { /* Error code (only for PT_FLG_REPLY) */
 			int32_t code;
 		} PT_PACKED error;
 	} PT_PACKED;
 } PT_PACKED;
 
+
+/*
+ * Protocol v2
+ *
+ * Version 2 clients connect to PT_SOCKET_V2, which is a SOCK_SEQPACKET
+ * socket. Each packet is one frame. A frame carries one or more records.
+ * Each record is a struct pt_record header followed by the payload,
+ * which is padded to a multiple of 4 bytes.
+ * The record header holds the message ID and flags. The payload is
+ * the member of the message union of struct pt_message, that is used
+ * by the message ID (see pt_payload_size()). Shorter payloads are padded
+ * with zeros by the receiver.
+ * The replies to all requests of a frame are sent in one frame.
+ *
+ * Requests may carry a non-zero tag in the record header. The reply
+ * to a request carries the same tag. So clients can keep several
+ * requests in flight and match the replies by tag.
+ * Notifications have a tag of 0.
+ *
+ * The first record sent by the client must be PTREQ_HELLO with the
+ * highest protocol version supported by the client. The reply holds
+ * the negotiated version.
+ */
+
+#define PT_PROTOCOL_VERSION	2
+#define PT_FRAME_MAX_SIZE	512
+
+struct pt_record {
+	uint16_t id;
+	uint16_t flags;
+	uint16_t length;	/* Payload length, without header and padding */
+	uint16_t tag;		/* Request tag. Echoed in the reply */
+} PT_PACKED;
+
+#define PT_PAYLOAD_MAX_SIZE	(sizeof(struct pt_message) - offsetof(struct pt_message, error))
+
+#define PT_PAYLOAD_SIZE(member)	sizeof(((struct pt_message *)0)->member)
+
+/* Get the payload length of a message. */
+static inline size_t pt_payload_size(const struct pt_message *msg)
+{
+	static const struct {
+		uint16_t id;
+		uint8_t request;	/* Request payload length */
+		uint8_t reply;		/* Reply or notification payload length */
+	} sizes[] = {
+		{ PTREQ_PING, 0, PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_WANT_NOTIFY, PT_PAYLOAD_SIZE(notify), PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_XEVREP, 0, PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_HELLO, PT_PAYLOAD_SIZE(hello), PT_PAYLOAD_SIZE(hello), },
+		{ PTREQ_STATE_PAGE, 0, PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_EVENT_RING, 0, PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_SESSION, PT_PAYLOAD_SIZE(session), PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_GET_IF_CHANGED, PT_PAYLOAD_SIZE(generation), PT_PAYLOAD_SIZE(generation), },
+		{ PTREQ_BL_GETSTATE, 0, PT_PAYLOAD_SIZE(bl_stat), },
+		{ PTREQ_BL_SETBRIGHTNESS, PT_PAYLOAD_SIZE(bl_set), PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_BL_AUTODIM, PT_PAYLOAD_SIZE(bl_autodim), PT_PAYLOAD_SIZE(error), },
+		{ PTREQ_BL_AUTODIM_GETSTATE, 0, PT_PAYLOAD_SIZE(autodim_stat), },
+		{ PTREQ_BAT_GETSTATE, 0, PT_PAYLOAD_SIZE(bat_stat), },
+		{ PTNOTI_SRVDOWN, 0, 0, },
+		{ PTNOTI_BL_CHANGED, PT_PAYLOAD_SIZE(bl_stat), PT_PAYLOAD_SIZE(bl_stat), },
+		{ PTNOTI_BAT_CHANGED, PT_PAYLOAD_SIZE(bat_stat), PT_PAYLOAD_SIZE(bat_stat), },
+	};
+	uint16_t flags = ntohs(msg->flags);
+	unsigned int i;
+
+	if ((flags & PT_FLG_REPLY) && !(flags & PT_FLG_OK))
+		return PT_PAYLOAD_SIZE(error);
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		if (sizes[i].id == ntohs(msg->id))
+			return (flags & PT_FLG_REPLY) ? sizes[i].reply : sizes[i].request;
+	}
+
+	return PT_PAYLOAD_MAX_SIZE;
+}
+
+static inline size_t pt_record_size(size_t payload_length)
+{
+	return sizeof(struct pt_record) + ((payload_length + 3) & ~(size_t)3);
+}
+
+/* Append a message as record to a frame of size frame_size.
+ * Returns the new frame size or 0, if the record does not fit. */
+static inline size_t pt_frame_put(uint8_t *frame, size_t frame_size,
+				  const struct pt_message *msg, uint16_t tag)
+{
+	struct pt_record rec;
+	size_t length = pt_payload_size(msg);
+	size_t size = pt_record_size(length);
+
+	if (frame_size + size > PT_FRAME_MAX_SIZE)
+		return 0;
+	memset(frame + frame_size, 0, size);
+	rec.id = msg->id;
+	rec.flags = msg->flags;
+	rec.length = htons(length);
+	rec.tag = htons(tag);
+	memcpy(frame + frame_size, &rec, sizeof(rec));
+	memcpy(frame + frame_size + sizeof(rec), &msg->error, length);
+
+	return frame_size + size;
+}
+
+/* Get the record at offset from a frame of size frame_size as message.
+ * The tag is stored in tag, if not NULL.
+ * Returns the offset of the next record or 0, if the record is malformed. */
+static inline size_t pt_frame_get(const uint8_t *frame, size_t frame_size,
+				  size_t offset, struct pt_message *msg,
+				  uint16_t *tag)
+{
+	struct pt_record rec;
+	size_t length;
+
+	if (offset + sizeof(rec) > frame_size)
+		return 0;
+	memcpy(&rec, frame + offset, sizeof(rec));
+	length = ntohs(rec.length);
+	if (offset + pt_record_size(length) > frame_size)
+		return 0;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->id = rec.id;
+	msg->flags = rec.flags;
+	if (tag)
+		*tag = ntohs(rec.tag);
+	if (length > PT_PAYLOAD_MAX_SIZE)
+		length = PT_PAYLOAD_MAX_SIZE;
+	memcpy(&msg->error, frame + offset + sizeof(rec), length);
+
+	return offset + pt_record_size(ntohs(rec.length));
+}
+
+/*
+ * State page
+ *
+ * The backend publishes the current backlight and battery state in
+ * a read-only shared memory page. The file descriptor is passed with
+ * SCM_RIGHTS in the reply to PTREQ_STATE_PAGE. Clients mmap it
+ * with PROT_READ and read it with pt_state_page_read().
+ * The page is written under a seqlock. The generation counters are
+ * incremented on each state change.
+ * When the backend is restarted, the page is retired by clearing
+ * the magic. Clients then have to request a new page.
+ */
+
+#define PT_STATE_MAGIC		0x50545354 /* "PTST" */
+
+struct pt_state_page {
+	uint32_t magic;
+	uint32_t seq;		/* Seqlock count. Odd while being written */
+	uint32_t bl_generation;
+	uint32_t bat_generation;
+	struct pt_message bl;	/* Same as PTNOTI_BL_CHANGED */
+	struct pt_message bat;	/* Same as PTNOTI_BAT_CHANGED */
+} PT_PACKED;
+
+#define PT_STATE_PAGE_READ_TRIES	1000
+
+/* Get a consistent copy of the state page.
+ * Returns 0 on success or -1, if no consistent copy could be taken
+ * or if the page was retired. */
+static inline int pt_state_page_read(const struct pt_state_page *page,
+				     struct pt_state_page *copy)
+{
+	unsigned int i;
+	uint32_t seq;
+
+	for (i = 0; i < PT_STATE_PAGE_READ_TRIES; i++) {
+		seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq)
+			return (copy->magic == PT_STATE_MAGIC) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/*
+ * Event ring
+ *
+ * All notifications are also published once to a read-only shared
+ * memory ring buffer. The file descriptor is passed with SCM_RIGHTS
+ * in the reply to PTREQ_EVENT_RING. Each reader keeps its own cursor,
+ * which is initialized to the current head.
+ * "head" is the number of events published so far. It also is
+ * a (shared, not private) futex word. Readers wait for new events with
+ * FUTEX_WAIT on head. The backend issues one FUTEX_WAKE per event,
+ * as long as a client, that requested the ring, is connected. So readers
+ * must keep their connection open.
+ * When the backend is restarted, the ring is retired by clearing the
+ * magic and all waiters are woken. Readers then have to request a new ring.
+ */
+
+#define PT_EVENT_RING_MAGIC	0x50544552 /* "PTER" */
+#define PT_EVENT_RING_SLOTS	64
+
+struct pt_event_slot {
+	uint32_t seq;		/* Event number + 1, or 0 while being written */
+	struct pt_message msg;
+} PT_PACKED;
+
+struct pt_event_ring {
+	uint32_t magic;
+	uint32_t nr_slots;
+	uint32_t head;		/* Number of published events. Futex word */
+	uint32_t reserved;
+	struct pt_event_slot slots[PT_EVENT_RING_SLOTS];
+} PT_PACKED;
+
+/* Read the next event at the cursor.
+ * Returns 1, if an event was read, 0 if there is no new event or -1,
+ * if the reader was overrun. In that case the cursor is moved to the
+ * head and the reader should re-read the state (e.g. the state page).
+ * Returns -2, if the ring was retired. */
+static inline int pt_event_ring_read(const struct pt_event_ring *ring,
+				     uint32_t *cursor, struct pt_message *msg)
+{
+	const struct pt_event_slot *slot;
+	uint32_t head, seq;
+
+	if (__atomic_load_n(&ring->magic, __ATOMIC_ACQUIRE) != PT_EVENT_RING_MAGIC)
+		return -2;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	if (*cursor == head)
+		return 0;
+	if (head - *cursor > PT_EVENT_RING_SLOTS)
+		goto overrun;
+	slot = &ring->slots[*cursor % PT_EVENT_RING_SLOTS];
+	seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+	if (seq != *cursor + 1)
+		goto overrun;
+	memcpy(msg, &slot->msg, sizeof(*msg));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+		goto overrun;
+	(*cursor)++;
+
+	return 1;
+
+overrun:
+	*cursor = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	return -1;
+}
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
@@ -32,6 +32,8 @@ static void usage(FILE *fd, int argc, char **argv)
 	fprintf(fd, "                              0=error, 1=info, 2=debug, 3=verbose\n");
 	fprintf(fd, "  -L|--logfile PATH           Write log to file\n");
 	fprintf(fd, "  -f|--force                  Force mode\n");
+	fprintf(fd, "  --takeover FD               Take over from the previous backend\n");
+	fprintf(fd, "                              (used internally on SIGHUP)\n");
 	fprintf(fd, "\n");
 	fprintf(fd, "  -h|--help                   Print this help text\n");
 }
@@ -45,9 +47,13 @@ int parse_commandline(int argc, char **argv)
 		{ "loglevel", required_argument, 0, 'l' },
 		{ "logfile", required_argument, 0, 'L' },
 		{ "force", no_argument, 0, 'f' },
+		{ "takeover", required_argument, 0, 'T' },
+		{ 0, },
 	};
 	int c, idx;
 
+	cmdargs.takeover_fd = -1;
+
 	while (1) {
 		c = getopt_long(argc, argv, "hBP:l:L:f",
 				long_options, &idx);
@@ -75,6 +81,12 @@ int parse_commandline(int argc, char **argv)
 		case 'f':
 			cmdargs.force = 1;
 			break;
+		case 'T':
+			if (sscanf(optarg, "%d", &cmdargs.takeover_fd) != 1) {
+				fprintf(stderr, "Failed to parse --takeover argument.\n");
+				return -1;
+			}
+			break;
 		default:
 			return -1;
 		}
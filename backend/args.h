@@ -7,6 +7,7 @@ struct cmdline_args {
 	const char *logfile;
 	const char *pidfile;
 	int force;
+	int takeover_fd;	/* State of the previous backend, or -1 */
 };
 
 extern struct cmdline_args cmdargs;
@@ -17,17 +17,30 @@
 #include "fileaccess.h"
 #include "util.h"
 #include "main.h"
+#include "inputdev.h"
 
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdio.h>
-#include <signal.h>
 #include <errno.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
 
 
+#define AUTODIM_INPUT_BATCH	64
+
+
+static void autodim_changed(struct autodim *ad)
+{
+	ad->bl->autodim_generation++;
+}
+
 static void autodim_set_backlight(struct autodim *ad, unsigned int percent)
 {
 	struct battery *battery = backend.battery;
@@ -42,6 +55,7 @@ static void autodim_set_backlight(struct autodim *ad, unsigned int percent)
 
 	if (percent != ad->bl_percent) {
 		ad->bl_percent = percent;
+		autodim_changed(ad);
 		backlight_set_percentage(ad->bl, percent);
 		logverbose("Autodim: Set backlight to %u percent.\n", percent);
 	}
@@ -54,6 +68,7 @@ static void autodim_handle_state(struct autodim *ad)
 	if (ad->state < ad->nr_steps) {
 		step = &ad->steps[ad->state];
 		ad->state++;
+		autodim_changed(ad);
 
 		autodim_set_backlight(ad, step->percent);
 	}
@@ -64,31 +79,408 @@ static void autodim_timer_stop(struct autodim *ad)
 	sleeptimer_dequeue(&ad->timer);
 }
 
+/* Returns the number of milliseconds since the last input activity. */
+static unsigned int autodim_idle_msec(struct autodim *ad)
+{
+	struct timespec now;
+	int64_t msec;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+		logerr("WARNING: clock_gettime() failed: %s\n",
+		       strerror(errno));
+		return 0;
+	}
+	msec = (int64_t)(now.tv_sec - ad->last_activity.tv_sec) * 1000 +
+	       (now.tv_nsec - ad->last_activity.tv_nsec) / 1000000;
+
+	return (unsigned int)clamp(msec, (int64_t)0, (int64_t)UINT_MAX);
+}
+
 static void autodim_timer_start(struct autodim *ad)
 {
-	unsigned int sec;
+	unsigned int deadline, idle;
 
-	if (ad->state == 0)
-		sec = ad->steps[0].second;
-	else if (ad->state < ad->nr_steps)
-		sec = ad->steps[ad->state].second - ad->steps[ad->state - 1].second;
-	else
+	if (ad->state >= ad->nr_steps)
 		return;
 
-	logverbose("autodim: Next event in %u sec\n", sec);
-	sleeptimer_set_timeout_relative(&ad->timer, sec * 1000);
+	/* Step deadlines are relative to the last input activity. */
+	deadline = ad->steps[ad->state].second * 1000;
+	idle = autodim_idle_msec(ad);
+	idle = min(idle, deadline);
+
+	logverbose("autodim: Next event in %u msec\n", deadline - idle);
+	sleeptimer_set_timeout_relative(&ad->timer, deadline - idle);
 	sleeptimer_enqueue(&ad->timer);
 }
 
+static void autodim_input_close(struct autodim_input *input)
+{
+	int fd = input->watch.fd;
+
+	logverbose("Autodim: Stop watching input device %s\n", input->path);
+	iowatch_remove(&input->watch);
+	close(fd);
+	list_del(&input->list);
+	free(input->path);
+	free(input);
+}
+
+static struct autodim_input * autodim_input_find(struct autodim *ad,
+						 const char *path)
+{
+	struct autodim_input *input;
+
+	list_for_each_entry(input, &ad->inputs, list) {
+		if (strcmp(input->path, path) == 0)
+			return input;
+	}
+
+	return NULL;
+}
+
+static void autodim_inputs_close(struct autodim *ad)
+{
+	struct autodim_input *input, *input_tmp;
+
+	list_for_each_entry_safe(input, input_tmp, &ad->inputs, list)
+		autodim_input_close(input);
+}
+
+/* Drain the event queue of an input device in large batches.
+ * We are only interested in the fact that something happened and when.
+ * Returns the number of events read or a negative error code. */
+static int autodim_input_drain(struct autodim_input *input,
+			       struct timespec *last_event)
+{
+	struct input_event ev[AUTODIM_INPUT_BATCH];
+	struct timespec ts;
+	ssize_t count;
+	int nr_events = 0, nr;
+
+	while (1) {
+		count = read(input->watch.fd, ev, sizeof(ev));
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -errno;
+		}
+		nr = count / sizeof(ev[0]);
+		if (nr && input->clock_monotonic && last_event) {
+			ts.tv_sec = ev[nr - 1].input_event_sec;
+			ts.tv_nsec = ev[nr - 1].input_event_usec * 1000;
+			if (timespec_after(&ts, last_event))
+				*last_event = ts;
+		}
+		nr_events += nr;
+		if ((size_t)count < sizeof(ev))
+			break; /* Queue is empty. */
+	}
+
+	return nr_events;
+}
+
+/* Drain all input devices. Returns true, if there was input activity.
+ * The time of the latest event is stored in last_event. */
+static int autodim_inputs_poll(struct autodim *ad, struct timespec *last_event)
+{
+	struct autodim_input *input, *input_tmp;
+	int nr_events, activity = 0;
+
+	memset(last_event, 0, sizeof(*last_event));
+	list_for_each_entry_safe(input, input_tmp, &ad->inputs, list) {
+		nr_events = autodim_input_drain(input, last_event);
+		if (nr_events < 0) {
+			logdebug("Autodim: Input device (fd=%d) failed: %s\n",
+				 input->watch.fd, strerror(-nr_events));
+			autodim_input_close(input);
+			continue;
+		}
+		if (nr_events)
+			activity = 1;
+	}
+
+	return activity;
+}
+
+/* Handle input activity that was found by polling.
+ * Use the event timestamp, if we have one, because the activity
+ * may have happened up to one holdoff period ago. */
+static void autodim_handle_polled_input(struct autodim *ad,
+					const struct timespec *last_event)
+{
+	int dimmed = (ad->state != 0);
+
+	autodim_handle_input_event(ad);
+	if (!dimmed && (last_event->tv_sec || last_event->tv_nsec))
+		ad->last_activity = *last_event;
+}
+
+static void autodim_inputs_enable(struct autodim *ad, int enable)
+{
+	struct autodim_input *input;
+
+	list_for_each_entry(input, &ad->inputs, list)
+		iowatch_modify(&input->watch, enable ? EPOLLIN : 0);
+}
+
+/* Continuous input (e.g. mouse movement) would wake us up for every
+ * single event report. Stop watching the input devices for a short
+ * holdoff period after an event and poll them when it expires instead.
+ * We only need to know the activity time with step granularity. */
+static void autodim_holdoff_start(struct autodim *ad)
+{
+	if (!ad->input_holdoff)
+		return;
+	if (!ad->holdoff_active) {
+		autodim_inputs_enable(ad, 0);
+		ad->holdoff_active = 1;
+	}
+	sleeptimer_set_timeout_relative(&ad->holdoff_timer, ad->input_holdoff);
+	sleeptimer_enqueue(&ad->holdoff_timer);
+}
+
+static void autodim_holdoff_stop(struct autodim *ad)
+{
+	if (!ad->holdoff_active)
+		return;
+	sleeptimer_dequeue(&ad->holdoff_timer);
+	autodim_inputs_enable(ad, 1);
+	ad->holdoff_active = 0;
+}
+
+static void autodim_holdoff_callback(struct sleeptimer *timer)
+{
+	struct autodim *ad = container_of(timer, struct autodim, holdoff_timer);
+	struct timespec last_event;
+
+	if (autodim_inputs_poll(ad, &last_event)) {
+		autodim_handle_polled_input(ad, &last_event);
+		autodim_holdoff_start(ad);
+	} else {
+		autodim_holdoff_stop(ad);
+	}
+}
+
+static void autodim_input_event(struct iowatch *w, uint32_t events)
+{
+	struct autodim_input *input = container_of(w, struct autodim_input, watch);
+	struct autodim *ad = input->ad;
+	int nr_events;
+
+	nr_events = autodim_input_drain(input, NULL);
+	if (nr_events < 0) {
+		logdebug("Autodim: Input device (fd=%d) failed: %s\n",
+			 w->fd, strerror(-nr_events));
+		autodim_input_close(input);
+		return;
+	}
+	if (!nr_events)
+		return;
+
+	autodim_handle_input_event(ad);
+	if (ad->state == 0 && !ad->suspended)
+		autodim_holdoff_start(ad);
+}
+
 static void autodim_timer_callback(struct sleeptimer *timer)
 {
 	struct autodim *ad = container_of(timer, struct autodim, timer);
+	struct timespec last_event;
 
 	logverbose("autodim: timer triggered\n");
-	autodim_handle_state(ad);
+	/* The input devices are not watched during holdoff.
+	 * Check for activity we did not see, yet. */
+	if (ad->holdoff_active) {
+		if (autodim_inputs_poll(ad, &last_event))
+			autodim_handle_polled_input(ad, &last_event);
+		else
+			autodim_holdoff_stop(ad);
+	}
+	/* Input events only update the activity timestamp.
+	 * If there was activity since the timer was armed,
+	 * the step is not due, yet. Just re-arm to the remaining time. */
+	if (ad->state < ad->nr_steps &&
+	    autodim_idle_msec(ad) >= ad->steps[ad->state].second * 1000)
+		autodim_handle_state(ad);
 	autodim_timer_start(ad);
 }
 
+static void autodim_input_setup(struct autodim_input *input,
+				int fd, const char *path)
+{
+	unsigned char types[EV_CNT / 8 + 1];
+	struct input_mask mask;
+	int clk = CLOCK_MONOTONIC;
+
+	/* Only wake up for event types that indicate a human being present.
+	 * EV_SYN is never filtered, but the kernel drops empty reports. */
+	memset(types, 0, sizeof(types));
+	types[EV_KEY / 8] |= 1 << (EV_KEY % 8);
+	types[EV_REL / 8] |= 1 << (EV_REL % 8);
+	types[EV_ABS / 8] |= 1 << (EV_ABS % 8);
+
+	memset(&mask, 0, sizeof(mask));
+	mask.type = 0; /* Event type mask */
+	mask.codes_size = sizeof(types);
+	mask.codes_ptr = (uintptr_t)types;
+	if (ioctl(fd, EVIOCSMASK, &mask)) {
+		/* Old kernel or not an evdev device. Receive everything. */
+		if (errno != ENOTTY && errno != EINVAL) {
+			logdebug("Autodim: Failed to set event mask on %s: %s\n",
+				 path, strerror(errno));
+		}
+	}
+
+	/* Get event timestamps that compare to our timers. */
+	input->clock_monotonic = !ioctl(fd, EVIOCSCLOCKID, &clk);
+}
+
+/* Decide whether the device is operated by a human and shall be watched.
+ * The include and exclude configuration overrides the classification. */
+static int autodim_input_wanted(struct autodim *ad,
+				const struct inputdev_info *info)
+{
+	if (inputdev_match(info, ad->input_include))
+		return 1;
+	if (inputdev_match(info, ad->input_exclude))
+		return 0;
+	return !!(info->classes & INPUTDEV_HUMAN);
+}
+
+static int autodim_input_open(struct autodim *ad, const char *path)
+{
+	struct autodim_input *input;
+	struct inputdev_info info;
+	int err, fd;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENODEV || errno == ENOENT)
+			return 0;
+		logerr("Failed to open %s: %s\n",
+		       path, strerror(errno));
+		return 0; /* Continue anyway */
+	}
+
+	err = inputdev_probe(fd, &info);
+	if (err) {
+		logverbose("Autodim: %s is not an evdev device\n", path);
+		close(fd);
+		return 0;
+	}
+	if (!autodim_input_wanted(ad, &info)) {
+		logverbose("Autodim: Ignoring input device %s \"%s\" (%04x:%04x)\n",
+			   path, info.name, info.vendor, info.product);
+		close(fd);
+		return 0;
+	}
+
+	input = zalloc(sizeof(*input));
+	if (!input) {
+		close(fd);
+		return -ENOMEM;
+	}
+	input->ad = ad;
+	input->path = strdup(path);
+	if (!input->path) {
+		free(input);
+		close(fd);
+		return -ENOMEM;
+	}
+	iowatch_init(&input->watch, "autodim-input", autodim_input_event);
+	autodim_input_setup(input, fd, path);
+	err = iowatch_add(&input->watch, fd,
+			  ad->holdoff_active ? 0 : EPOLLIN);
+	if (err) {
+		free(input->path);
+		free(input);
+		close(fd);
+		return err;
+	}
+	list_add_tail(&input->list, &ad->inputs);
+	logverbose("Autodim: Watching input device %s \"%s\" (%04x:%04x, class=%X)\n",
+		   path, info.name, info.vendor, info.product, info.classes);
+
+	return 0;
+}
+
+static void autodim_hotplug_handle(struct autodim *ad,
+				   const struct inotify_event *ev)
+{
+	struct autodim_input *input;
+	char path[PATH_MAX + 1];
+
+	if (!ev->len || !inputdev_is_event_node(ev->name))
+		return;
+	snprintf(path, sizeof(path), "/dev/input/%s", ev->name);
+	input = autodim_input_find(ad, path);
+
+	if (ev->mask & IN_DELETE) {
+		if (input)
+			autodim_input_close(input);
+		return;
+	}
+	/* New device node or changed permissions. */
+	if (!input)
+		autodim_input_open(ad, path);
+}
+
+static void autodim_hotplug_event(struct iowatch *w, uint32_t events)
+{
+	struct autodim *ad = container_of(w, struct autodim, hotplug_watch);
+	char buf[4096] ALIGN(__alignof__(struct inotify_event));
+	const struct inotify_event *ev;
+	ssize_t count, pos;
+
+	while (1) {
+		count = read(w->fd, buf, sizeof(buf));
+		if (count <= 0)
+			break;
+		for (pos = 0; pos < count;
+		     pos += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)&buf[pos];
+			autodim_hotplug_handle(ad, ev);
+		}
+	}
+}
+
+static void autodim_hotplug_exit(struct autodim *ad)
+{
+	int fd = ad->hotplug_watch.fd;
+
+	if (iowatch_active(&ad->hotplug_watch)) {
+		iowatch_remove(&ad->hotplug_watch);
+		close(fd);
+	}
+}
+
+/* Watch /dev/input for appearing and disappearing devices.
+ * Autodim works without hotplug support, so failures are not fatal. */
+static void autodim_hotplug_init(struct autodim *ad)
+{
+	int fd;
+
+	iowatch_init(&ad->hotplug_watch, "autodim-hotplug",
+		     autodim_hotplug_event);
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		logerr("Autodim: Failed to create inotify instance: %s\n",
+		       strerror(errno));
+		return;
+	}
+	if (inotify_add_watch(fd, "/dev/input",
+			      IN_CREATE | IN_ATTRIB | IN_DELETE) < 0) {
+		logerr("Autodim: Failed to watch /dev/input: %s\n",
+		       strerror(errno));
+		close(fd);
+		return;
+	}
+	if (iowatch_add(&ad->hotplug_watch, fd, EPOLLIN))
+		close(fd);
+}
+
 struct autodim * autodim_alloc(void)
 {
 	struct autodim *ad;
@@ -284,51 +676,41 @@ int autodim_init(struct autodim *ad, struct backlight *bl,
 {
 	LIST_HEAD(dir_entries);
 	struct dir_entry *dir_entry;
-	int err, i, fd, count, percent;
+	int err, count, percent;
 	char path[PATH_MAX + 1];
 
 	ad->bl = bl;
 	ad->bl->autodim_enabled++;
+	INIT_LIST_HEAD(&ad->inputs);
+
+	ad->input_include = strdup(config_get(config, "BACKLIGHT",
+					      "autodim_input_include", ""));
+	ad->input_exclude = strdup(config_get(config, "BACKLIGHT",
+					      "autodim_input_exclude", ""));
+	if (!ad->input_include || !ad->input_exclude) {
+		err = -ENOMEM;
+		goto error;
+	}
 
+	/* Start watching before the scan, so that no device is missed. */
+	autodim_hotplug_init(ad);
 	count = list_directory(&dir_entries, "/dev/input");
-	if (count <= 0) {
+	if (count < 0) {
 		logerr("Failed to list /dev/input\n");
 		err = -ENOENT;
-		goto error;
+		goto err_hotplug_exit;
 	}
-	ad->fds = calloc(count, sizeof(*ad->fds));
-	if (!ad->fds) {
-		err = -ENOMEM;
-		goto err_free_dir_entries;
-	}
-	i = 0;
 	list_for_each_entry(dir_entry, &dir_entries, list) {
 		if (dir_entry->type != DT_CHR)
 			continue;
+		if (!inputdev_is_event_node(dir_entry->name))
+			continue;
 
 		snprintf(path, sizeof(path), "/dev/input/%s", dir_entry->name);
-		fd = open(path, O_RDONLY);
-		if (fd < 0) {
-			if (errno == ENODEV)
-				continue;
-			logerr("Failed to open %s: %s\n",
-			       path, strerror(errno));
-			continue; /* Continue anyway */
-		}
-
-		err = fcntl(fd, F_SETFL, O_ASYNC | O_NONBLOCK);
-		err |= fcntl(fd, F_SETSIG, SIGUSR1);
-		err |= fcntl(fd, F_SETOWN, getpid());
-		if (err) {
-			logerr("Failed to set O_ASYNC\n");
-			close(fd);
-			err = -ENOENT;
-			goto err_free_fds;
-		}
-		ad->fds[i++] = fd;
-		logverbose("Autodim: Watching input device %s\n", path);
+		err = autodim_input_open(ad, path);
+		if (err)
+			goto err_close_inputs;
 	}
-	ad->nr_fds = i;
 	dir_entries_free(&dir_entries);
 
 	percent = backlight_get_percentage(ad->bl);
@@ -338,21 +720,26 @@ int autodim_init(struct autodim *ad, struct backlight *bl,
 	ad->max_percent = percent;
 	err = autodim_steps_get(ad, config);
 	if (err)
-		goto err_free_fds;
-
-	sleeptimer_init(&ad->timer, "autodim", autodim_timer_callback);
+		goto err_close_inputs;
+	ad->input_holdoff = max(0, config_get_int(config, "BACKLIGHT",
+						  "autodim_input_holdoff", 1000));
+
+	sleeptimer_init(&ad->timer, "autodim",
+			SLEEPTIMER_INTERACTIVE, autodim_timer_callback);
+	sleeptimer_init(&ad->holdoff_timer, "autodim-holdoff",
+			SLEEPTIMER_BACKGROUND, autodim_holdoff_callback);
+	clock_gettime(CLOCK_MONOTONIC, &ad->last_activity);
 	autodim_timer_start(ad);
 
 	logdebug("Auto-dimming enabled\n");
 
 	return 0;
 
-err_free_fds:
-	free(ad->fds);
-	ad->fds = NULL;
-	ad->nr_fds = 0;
-err_free_dir_entries:
+err_close_inputs:
+	autodim_inputs_close(ad);
 	dir_entries_free(&dir_entries);
+err_hotplug_exit:
+	autodim_hotplug_exit(ad);
 error:
 	ad->bl->autodim_enabled--;
 
@@ -361,18 +748,15 @@ error:
 
 void autodim_destroy(struct autodim *ad)
 {
-	unsigned int i;
-
 	if (!ad)
 		return;
 
 	ad->bl->autodim_enabled--;
 
 	autodim_timer_stop(ad);
-	for (i = 0; i < ad->nr_fds; i++)
-		close(ad->fds[i]);
-	free(ad->fds);
-	ad->fds = NULL;
+	autodim_holdoff_stop(ad);
+	autodim_hotplug_exit(ad);
+	autodim_inputs_close(ad);
 
 	logdebug("Auto-dimming disabled\n");
 }
@@ -381,6 +765,8 @@ void autodim_free(struct autodim *ad)
 {
 	if (ad) {
 		free(ad->steps);
+		free(ad->input_include);
+		free(ad->input_exclude);
 		memset(ad, 0, sizeof(*ad));
 		free(ad);
 	}
@@ -393,19 +779,30 @@ void autodim_suspend(struct autodim *ad)
 	if (!ad->suspended) {
 		autodim_timer_stop(ad);
 		//TODO disable input events.
+		autodim_changed(ad);
 		logdebug("Auto-dimming suspended\n");
 	}
 	ad->suspended++;
 }
 
+/* Reset to the undimmed state and restart the step timer. */
+static void autodim_restart(struct autodim *ad)
+{
+	clock_gettime(CLOCK_MONOTONIC, &ad->last_activity);
+	ad->state = 0;
+	autodim_changed(ad);
+	if (!ad->suspended)
+		autodim_timer_start(ad);
+	autodim_set_backlight(ad, ad->max_percent);
+}
+
 void autodim_resume(struct autodim *ad)
 {
 	if (!ad)
 		return;
 	ad->suspended--;
 	if (!ad->suspended) {
-		autodim_handle_input_event(ad);
-		autodim_timer_start(ad);
+		autodim_restart(ad);
 		logdebug("Auto-dimming resumed\n");
 	}
 }
@@ -417,16 +814,52 @@ void autodim_set_max_percent(struct autodim *ad, int max_percent)
 	max_percent = clamp(max_percent, 0, 100);
 	if (ad->max_percent != (unsigned int)max_percent) {
 		ad->max_percent = (unsigned int)max_percent;
-		autodim_handle_input_event(ad);
+		autodim_restart(ad);
 	}
 }
 
-void autodim_handle_input_event(struct autodim *ad)
+/* Continue at the dim step of the previous backend,
+ * without changing the brightness. */
+void autodim_takeover(struct autodim *ad, unsigned int max_percent,
+		      unsigned int step)
 {
-	logverbose("Autodim: Got input event.\n");
-	ad->state = 0;
+	ad->max_percent = min(max_percent, 100u);
+	ad->state = min(step, ad->nr_steps);
+	clock_gettime(CLOCK_MONOTONIC, &ad->last_activity);
+	autodim_timer_stop(ad);
 	autodim_timer_start(ad);
-	autodim_set_backlight(ad, ad->max_percent);
+}
+
+int autodim_fill_pt_message_stat(struct autodim *ad, struct pt_message *msg)
+{
+	memset(&msg->autodim_stat, 0, sizeof(msg->autodim_stat));
+	if (!ad)
+		return 0;
+
+	msg->autodim_stat.flags = htonl(PT_AUTODIM_STAT_ENABLED);
+	if (ad->bl->autodim_enabled_on_ac)
+		msg->autodim_stat.flags |= htonl(PT_AUTODIM_STAT_ENABLED_AC);
+	if (ad->suspended)
+		msg->autodim_stat.flags |= htonl(PT_AUTODIM_STAT_SUSPENDED);
+	msg->autodim_stat.max_percent = htonl(ad->max_percent);
+	msg->autodim_stat.percent = htonl(ad->bl_percent);
+	msg->autodim_stat.step = htonl(ad->state);
+	msg->autodim_stat.nr_steps = htonl(ad->nr_steps);
+
+	return 0;
+}
+
+void autodim_handle_input_event(struct autodim *ad)
+{
+	/* This is the hot path while the user is typing.
+	 * Only record the activity. The already running timer
+	 * picks up the new timestamp when it fires. */
+	if (ad->state == 0 || ad->suspended) {
+		clock_gettime(CLOCK_MONOTONIC, &ad->last_activity);
+		return;
+	}
+	logverbose("Autodim: Got input event while dimmed.\n");
+	autodim_restart(ad);
 }
 
 void autodim_handle_battery_event(struct autodim *ad)
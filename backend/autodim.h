@@ -4,7 +4,19 @@
 #include "backlight.h"
 #include "timer.h"
 #include "conf.h"
+#include "eventloop.h"
+#include "list.h"
 
+#include <time.h>
+
+
+struct autodim_input {
+	struct autodim *ad;
+	char *path;
+	struct iowatch watch;
+	int clock_monotonic;
+	struct list_head list;
+};
 
 struct autodim_step {
 	unsigned int second;
@@ -13,12 +25,18 @@ struct autodim_step {
 
 struct autodim {
 	struct backlight *bl;
-	int *fds;
-	unsigned int nr_fds;
+	struct list_head inputs;
+	struct iowatch hotplug_watch;
 	struct sleeptimer timer;
+	struct sleeptimer holdoff_timer;
 
 	int suspended;
 	unsigned int state;
+	struct timespec last_activity;
+	char *input_include;
+	char *input_exclude;
+	unsigned int input_holdoff;
+	int holdoff_active;
 	unsigned int bl_percent;
 	unsigned int max_percent;
 	struct autodim_step *steps;
@@ -37,6 +55,10 @@ void autodim_suspend(struct autodim *ad);
 void autodim_resume(struct autodim *ad);
 
 void autodim_set_max_percent(struct autodim *ad, int max_percent);
+void autodim_takeover(struct autodim *ad, unsigned int max_percent,
+		      unsigned int step);
+
+int autodim_fill_pt_message_stat(struct autodim *ad, struct pt_message *msg);
 
 void autodim_handle_input_event(struct autodim *ad);
 void autodim_handle_battery_event(struct autodim *ad);
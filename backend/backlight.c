@@ -15,6 +15,7 @@
 #include "backlight.h"
 #include "log.h"
 #include "main.h"
+#include "statepage.h"
 #include "x11lock.h"
 #include "util.h"
 
@@ -101,7 +102,7 @@ static void fbblank_init(struct backlight *b)
 	if (!fbdev)
 		return;
 
-	fd = open(fbdev, O_RDWR);
+	fd = open(fbdev, O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
 		logerr("Failed to open framebuffer dev %s: %s\n",
 		       fbdev, strerror(errno));
@@ -158,7 +159,7 @@ static void backlight_poll_callback(struct sleeptimer *timer)
 	struct backlight *b = container_of(timer, struct backlight, timer);
 
 	b->update(b);
-	sleeptimer_set_timeout_relative(&b->timer, b->poll_interval);
+	sleeptimer_set_timeout_aligned(&b->timer, b->poll_interval);
 	sleeptimer_enqueue(&b->timer);
 }
 
@@ -166,6 +167,8 @@ void backlight_init(struct backlight *b, const char *name)
 {
 	memset(b, 0, sizeof(*b));
 	b->name = name;
+	b->generation = 1;
+	b->autodim_generation = 1;
 	b->min_brightness = default_min_brightness;
 	b->max_brightness = default_max_brightness;
 	b->brightness_step = default_brightness_step;
@@ -173,6 +176,20 @@ void backlight_init(struct backlight *b, const char *name)
 	b->set_brightness = default_set_brightness;
 	b->screen_lock = default_screen_lock;
 	b->screen_is_locked = default_screen_is_locked;
+	sleeptimer_init(&b->timer, "backlight",
+			SLEEPTIMER_BACKGROUND, backlight_poll_callback);
+}
+
+/* (Re)start polling with the interval. 0 stops polling. */
+void backlight_poll_start(struct backlight *b, unsigned int interval)
+{
+	b->poll_interval = interval;
+	if (!interval) {
+		sleeptimer_dequeue(&b->timer);
+		return;
+	}
+	sleeptimer_set_timeout_aligned(&b->timer, interval);
+	sleeptimer_enqueue(&b->timer);
 }
 
 static void backlight_start(struct backlight *b)
@@ -181,11 +198,12 @@ static void backlight_start(struct backlight *b)
 
 	if (b->poll_interval) {
 		b->update(b);
-		sleeptimer_init(&b->timer, "backlight", backlight_poll_callback);
-		sleeptimer_set_timeout_relative(&b->timer, b->poll_interval);
-		sleeptimer_enqueue(&b->timer);
+		backlight_poll_start(b, b->poll_interval);
 	}
 
+	/* Keep the brightness set up by the previous backend. */
+	if (backend.takeover)
+		return;
 	percent = config_get_int(backend.config, "BACKLIGHT",
 				 "startup_percent", 100);
 	percent = clamp(percent, 0, 100);
@@ -219,6 +237,7 @@ void backlight_destroy(struct backlight *b)
 	if (!b)
 		return;
 
+	sleeptimer_dequeue(&b->timer);
 	fbblank_exit(b);
 	b->screen_lock(b, 0);
 
@@ -269,9 +288,11 @@ int backlight_notify_state_change(struct backlight *b)
 	};
 	int err;
 
+	b->generation++;
 	err = backlight_fill_pt_message_stat(b, &msg);
 	if (err)
 		return err;
+	statepage_update_backlight(b);
 	notify_clients(&msg, PT_FLG_OK);
 
 	return 0;
@@ -22,6 +22,8 @@ struct backlight {
 	unsigned int poll_interval;
 
 	/* Internal */
+	uint32_t generation;	/* Bumped on each state change */
+	uint32_t autodim_generation; /* Bumped on each autodim state change */
 	int autodim_enabled;
 	int autodim_enabled_on_ac;
 	int framebuffer_fd;
@@ -36,6 +38,7 @@ void backlight_destroy(struct backlight *b);
 
 int backlight_fill_pt_message_stat(struct backlight *b, struct pt_message *msg);
 int backlight_notify_state_change(struct backlight *b);
+void backlight_poll_start(struct backlight *b, unsigned int interval);
 
 int backlight_set_brightness(struct backlight *b, int value);
 int backlight_set_percentage(struct backlight *b, unsigned int percent);
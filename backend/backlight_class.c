@@ -25,6 +25,8 @@
 
 
 #define BASEPATH	"/class/backlight"
+/* Poll interval, if brightness changes are not notified */
+#define POLL_INTERVAL	2000
 
 
 static int backlight_class_max_brightness(struct backlight *b)
@@ -95,10 +97,26 @@ static int backlight_class_update(struct backlight *b)
 	return 0;
 }
 
+static void backlight_class_notify(struct iowatch *w, uint32_t events)
+{
+	struct backlight_class *bc = container_of(w, struct backlight_class, actual_br_watch);
+
+	/* Reading the attribute acknowledges the notification.
+	 * Stop watching on errors, because the notification would
+	 * stay pending. Poll instead. */
+	if (backlight_class_update(&bc->backlight) < 0) {
+		logerr("class backlight: Disabling the brightness change watch\n");
+		iowatch_remove(&bc->actual_br_watch);
+		backlight_poll_start(&bc->backlight, POLL_INTERVAL);
+	}
+}
+
 static void backlight_class_destroy(struct backlight *b)
 {
 	struct backlight_class *bc = container_of(b, struct backlight_class, backlight);
 
+	if (iowatch_active(&bc->actual_br_watch))
+		iowatch_remove(&bc->actual_br_watch);
 	file_close(bc->actual_br_file);
 	file_close(bc->set_br_file);
 
@@ -146,7 +164,7 @@ static struct backlight * backlight_class_probe(void)
 	struct backlight_class *bc;
 	struct fileaccess *file, *actual_br_file = NULL, *set_br_file = NULL;
 	LIST_HEAD(dir_entries);
-	int err, res, max_brightness;
+	int err, res, max_brightness, poll_interval;
 	const char *dirname;
 
 	err = list_sysfs_directory(&dir_entries, BASEPATH);
@@ -190,12 +208,23 @@ static struct backlight * backlight_class_probe(void)
 	bc->backlight.set_brightness = backlight_class_set_brightness;
 	bc->backlight.destroy = backlight_class_destroy;
 	bc->backlight.update = backlight_class_update;
-	bc->backlight.poll_interval = 2000;
 
 	res = backlight_class_read_file(bc);
 	if (res < 0)
 		goto err_free;
 	bc->brightness = res;
+
+	/* The backlight core notifies actual_brightness on changes through
+	 * sysfs and hotkeys. Poll rarely then, in case a driver
+	 * changes the brightness without notifying. */
+	iowatch_init(&bc->actual_br_watch, "backlight-change",
+		     backlight_class_notify);
+	err = iowatch_add(&bc->actual_br_watch, actual_br_file->fd, EPOLLPRI);
+	poll_interval = config_get_int(backend.config, "BACKLIGHT_CLASS",
+				       "poll_interval",
+				       err ? POLL_INTERVAL : 30000);
+	bc->backlight.poll_interval = max(poll_interval, 0);
+
 	backlight_notify_state_change(&bc->backlight);
 
 	dir_entries_free(&dir_entries);
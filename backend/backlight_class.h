@@ -2,12 +2,15 @@
 #define BACKEND_BACKLIGHT_CLASS_H_
 
 #include "backlight.h"
+#include "eventloop.h"
 
 struct backlight_class {
 	struct backlight backlight;
 
 	struct fileaccess *actual_br_file;
 	struct fileaccess *set_br_file;
+	/* Notified via sysfs_notify() on brightness changes */
+	struct iowatch actual_br_watch;
 
 	int max_brightness;
 	int brightness;
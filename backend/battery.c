@@ -15,6 +15,7 @@
 #include "battery.h"
 #include "log.h"
 #include "main.h"
+#include "statepage.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -100,14 +101,86 @@ static void battery_poll_callback(struct sleeptimer *timer)
 	struct battery *b = container_of(timer, struct battery, timer);
 
 	b->update(b);
-	sleeptimer_set_timeout_relative(&b->timer, b->poll_interval);
+	sleeptimer_set_timeout_aligned(&b->timer, b->poll_interval);
 	sleeptimer_enqueue(&b->timer);
 }
 
+static int default_uevent_match(struct battery *b, const char *devpath)
+{
+	return 1;
+}
+
+/* Returns 1, if the uevent devpath refers to the power supply
+ * that the sysfs file belongs to. */
+int battery_power_supply_match(const char *devpath, const char *filename)
+{
+	const char *name, *end, *devname;
+	size_t len;
+
+	if (!devpath || !filename)
+		return 0;
+	name = strstr(filename, "/power_supply/");
+	if (!name)
+		return 0;
+	name += strlen("/power_supply/");
+	end = strchr(name, '/');
+	len = end ? (size_t)(end - name) : strlen(name);
+	devname = strrchr(devpath, '/');
+	devname = devname ? devname + 1 : devpath;
+
+	return len && strlen(devname) == len &&
+	       strncmp(devname, name, len) == 0;
+}
+
+static int uevent_is_battery(const struct uevent_msg *msg)
+{
+	struct uevent_iter it;
+	struct uevent_var var;
+
+	uevent_iter_init(&it, msg->vars, msg->vars_len);
+	uevent_for_each_var(&var, &it) {
+		if (uevent_key_is(&var, "POWER_SUPPLY_TYPE"))
+			return uevent_value_is(&var, "Battery");
+	}
+
+	return 0;
+}
+
+static void battery_uevent_callback(struct uevent_listener *l,
+				    const struct uevent_msg *msg)
+{
+	struct battery *b = container_of(l, struct battery, uevent);
+
+	/* A NULL action means that events were lost. Always resync then. */
+	if (msg->action) {
+		if (!b->uevent_match(b, msg->devpath))
+			return;
+		/* Only trust the uevents, once the battery itself
+		 * reported a change. Some firmware only reports AC events. */
+		if (!b->uevent_seen && strcmp(msg->action, "change") == 0 &&
+		    uevent_is_battery(msg)) {
+			b->uevent_seen = 1;
+			b->poll_interval = b->safety_poll_interval;
+			logdebug("battery: Got a battery uevent. "
+				 "Safety poll interval %u ms\n",
+				 b->poll_interval);
+			if (!b->poll_interval)
+				sleeptimer_dequeue(&b->timer);
+		}
+	}
+	b->update(b);
+	if (b->poll_interval) {
+		/* Restart the poll. */
+		sleeptimer_set_timeout_aligned(&b->timer, b->poll_interval);
+		sleeptimer_enqueue(&b->timer);
+	}
+}
+
 void battery_init(struct battery *b, const char *name)
 {
 	memset(b, 0, sizeof(*b));
 	b->name = name;
+	b->generation = 1;
 	b->on_ac = default_on_ac;
 	b->charger_enable = default_charger_enable;
 	b->charging = default_charging;
@@ -117,14 +190,30 @@ void battery_init(struct battery *b, const char *name)
 	b->capacity_mAh = default_capacity_mAh;
 	b->current_mA = default_current_mA;
 	b->temperature_K = default_temperature_K;
+	b->uevent_match = default_uevent_match;
+	uevent_listener_init(&b->uevent, NULL, battery_uevent_callback);
 }
 
 static void battery_start(struct battery *b)
 {
-	if (b->poll_interval) {
+	int interval;
+
+	sleeptimer_init(&b->timer, "battery",
+			SLEEPTIMER_BULK, battery_poll_callback);
+	if (b->uevent_subsystem) {
+		b->uevent.subsystem = b->uevent_subsystem;
+		if (!uevent_listener_register(&b->uevent)) {
+			interval = config_get_int(backend.config, "BATTERY",
+						  "safety_poll_interval", 60000);
+			b->safety_poll_interval = max(interval, 0);
+			logdebug("battery: Updating on %s uevents\n",
+				 b->uevent_subsystem);
+		}
+	}
+	if (b->poll_interval || uevent_listener_active(&b->uevent))
 		b->update(b);
-		sleeptimer_init(&b->timer, "battery", battery_poll_callback);
-		sleeptimer_set_timeout_relative(&b->timer, b->poll_interval);
+	if (b->poll_interval) {
+		sleeptimer_set_timeout_aligned(&b->timer, b->poll_interval);
 		sleeptimer_enqueue(&b->timer);
 	}
 }
@@ -150,8 +239,11 @@ struct battery * battery_probe(void)
 
 void battery_destroy(struct battery *b)
 {
-	if (b)
-		b->destroy(b);
+	if (!b)
+		return;
+	uevent_listener_unregister(&b->uevent);
+	sleeptimer_dequeue(&b->timer);
+	b->destroy(b);
 }
 
 static void battery_emergency_check(struct battery *b)
@@ -243,6 +335,7 @@ int battery_notify_state_change(struct battery *b)
 	};
 	int err;
 
+	b->generation++;
 	battery_emergency_check(b);
 
 	if (backend.autodim)
@@ -251,6 +344,7 @@ int battery_notify_state_change(struct battery *b)
 	err = battery_fill_pt_message_stat(b, &msg);
 	if (err)
 		return err;
+	statepage_update_battery(b);
 	notify_clients(&msg, PT_FLG_OK);
 
 	return 0;
@@ -4,6 +4,7 @@
 #include "timer.h"
 #include "api.h"
 #include "probe.h"
+#include "uevent.h"
 
 
 struct battery {
@@ -34,10 +35,20 @@ struct battery {
 	void (*destroy)(struct battery *b);
 	int (*update)(struct battery *b);
 	unsigned int poll_interval;
+	/* Update immediately on uevents of this subsystem. NULL if none.
+	 * poll_interval is replaced by the safety poll interval,
+	 * once the battery sent a change uevent. */
+	const char *uevent_subsystem;
+	/* Returns 1 if the uevent of the device belongs to this battery. */
+	int (*uevent_match)(struct battery *b, const char *devpath);
 
 	/* Internal */
 	struct sleeptimer timer;
+	struct uevent_listener uevent;
+	unsigned int safety_poll_interval;
+	int uevent_seen;
 	int emergency_handled;
+	uint32_t generation;	/* Bumped on each state change */
 };
 
 void battery_init(struct battery *b, const char *name);
@@ -47,6 +58,7 @@ void battery_destroy(struct battery *b);
 
 int battery_fill_pt_message_stat(struct battery *b, struct pt_message *msg);
 int battery_notify_state_change(struct battery *b);
+int battery_power_supply_match(const char *devpath, const char *filename);
 
 DECLARE_PROBES(battery);
 #define BATTERY_PROBE(_name, _func)	DEFINE_PROBE(battery, _name, _func)
@@ -29,18 +29,16 @@ static int battery_acpi_update(struct battery *b)
 {
 	struct battery_acpi *ba = container_of(b, struct battery_acpi, battery);
 	int value, err, value_changed = 0;
-	struct fileaccess *file;
 
 	if (strempty(ba->ac_online_filename)) {
 		value = -1;
 	} else {
-		file = sysfs_file_open(O_RDONLY, ba->ac_online_filename);
-		if (!file) {
+		err = sysfs_attr_read_int(&ba->ac_online_file,
+					  ba->ac_online_filename, &value, 10);
+		if (err == -ENOENT) {
 			logerr("WARNING: Failed to open ac/online file\n");
 			return -ETXTBSY;
 		}
-		err = file_read_int(file, &value, 10);
-		file_close(file);
 		if (err) {
 			logerr("WARNING: Failed to read ac/online file\n");
 			return -ETXTBSY;
@@ -52,14 +50,11 @@ static int battery_acpi_update(struct battery *b)
 	}
 
 	value = 0;
-	file = sysfs_file_open(O_RDONLY, ba->charge_max_filename);
-	if (file) {
-		err = file_read_int(file, &value, 10);
-		file_close(file);
-		if (err) {
-			logerr("WARNING: Failed to read charge_max file\n");
-			return -ETXTBSY;
-		}
+	err = sysfs_attr_read_int(&ba->charge_max_file,
+				  ba->charge_max_filename, &value, 10);
+	if (err && err != -ENOENT) {
+		logerr("WARNING: Failed to read charge_max file\n");
+		return -ETXTBSY;
 	}
 	if (value != ba->charge_max) {
 		ba->charge_max = value;
@@ -67,14 +62,11 @@ static int battery_acpi_update(struct battery *b)
 	}
 
 	value = 0;
-	file = sysfs_file_open(O_RDONLY, ba->charge_now_filename);
-	if (file) {
-		err = file_read_int(file, &value, 10);
-		file_close(file);
-		if (err) {
-			logerr("WARNING: Failed to read charge_now file\n");
-			return -ETXTBSY;
-		}
+	err = sysfs_attr_read_int(&ba->charge_now_file,
+				  ba->charge_now_filename, &value, 10);
+	if (err && err != -ENOENT) {
+		logerr("WARNING: Failed to read charge_now file\n");
+		return -ETXTBSY;
 	}
 	value = min(value, ba->charge_max);
 	if (value != ba->charge_now) {
@@ -109,10 +101,21 @@ static int battery_acpi_charge_level(struct battery *b)
 	return ba->charge_now;
 }
 
+static int battery_acpi_uevent_match(struct battery *b, const char *devpath)
+{
+	struct battery_acpi *ba = container_of(b, struct battery_acpi, battery);
+
+	return battery_power_supply_match(devpath, ba->charge_now_filename) ||
+	       battery_power_supply_match(devpath, ba->ac_online_filename);
+}
+
 static void battery_acpi_destroy(struct battery *b)
 {
 	struct battery_acpi *ba = container_of(b, struct battery_acpi, battery);
 
+	file_close(ba->ac_online_file);
+	file_close(ba->charge_max_file);
+	file_close(ba->charge_now_file);
 	free(ba->ac_online_filename);
 	free(ba->charge_max_filename);
 	free(ba->charge_now_filename);
@@ -323,9 +326,15 @@ static struct battery * battery_acpi_probe(void)
 	ba->battery.max_level = battery_acpi_max_level;
 	ba->battery.charge_level = battery_acpi_charge_level;
 	ba->battery.poll_interval = 10000;
+	ba->battery.uevent_subsystem = "power_supply";
+	ba->battery.uevent_match = battery_acpi_uevent_match;
 	ba->ac_online_filename = strdup(ac_file);
 	ba->charge_max_filename = strdup(full_file);
 	ba->charge_now_filename = strdup(now_file);
+	if (!strempty(ac_file))
+		ba->ac_online_file = sysfs_file_open(O_RDONLY, "%s", ac_file);
+	ba->charge_max_file = sysfs_file_open(O_RDONLY, "%s", full_file);
+	ba->charge_now_file = sysfs_file_open(O_RDONLY, "%s", now_file);
 
 	return &ba->battery;
 
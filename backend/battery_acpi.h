@@ -2,6 +2,7 @@
 #define BACKEND_BATTERY_ACPI_H_
 
 #include "battery.h"
+#include "fileaccess.h"
 
 
 struct battery_acpi {
@@ -14,6 +15,11 @@ struct battery_acpi {
 	char *ac_online_filename;
 	char *charge_max_filename;
 	char *charge_now_filename;
+
+	/* Kept open between polls */
+	struct fileaccess *ac_online_file;
+	struct fileaccess *charge_max_file;
+	struct fileaccess *charge_now_file;
 };
 
 #endif /* BACKEND_BATTERY_ACPI_H_ */
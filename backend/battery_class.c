@@ -15,71 +15,223 @@
 #include "battery_class.h"
 #include "util.h"
 #include "fileaccess.h"
+#include "uevent.h"
 #include "log.h"
 
 #include <limits.h>
+#include <stdlib.h>
 #include <errno.h>
 
 
 #define BASEPATH	"/class/power_supply"
 
+/* A sysfs attribute is at most one page. */
+#define UEVENT_BUF_SIZE	4096
+
+#define VAL_UNKNOWN	INT_MIN
+
+/* Raw POWER_SUPPLY_* values of the battery uevent. */
+struct supply_values {
+	int present;
+	int status;		/* Charging status; 1, 0 or -1 if unknown */
+	int status_on_ac;	/* AC status derived from status; 1, 0 or -1 */
+	int capacity;		/* % */
+	int charge_full;	/* uAh */
+	int charge_now;		/* uAh */
+	int energy_full;	/* uWh */
+	int energy_now;		/* uWh */
+	int current_now;	/* uA */
+	int power_now;		/* uW */
+	int voltage_now;	/* uV */
+	int voltage_min_design;	/* uV */
+	int temp;		/* 1/10 degC */
+};
+
+static void supply_values_init(struct supply_values *v)
+{
+	v->present = 1;
+	v->status = -1;
+	v->status_on_ac = -1;
+	v->capacity = VAL_UNKNOWN;
+	v->charge_full = VAL_UNKNOWN;
+	v->charge_now = VAL_UNKNOWN;
+	v->energy_full = VAL_UNKNOWN;
+	v->energy_now = VAL_UNKNOWN;
+	v->current_now = VAL_UNKNOWN;
+	v->power_now = VAL_UNKNOWN;
+	v->voltage_now = VAL_UNKNOWN;
+	v->voltage_min_design = VAL_UNKNOWN;
+	v->temp = VAL_UNKNOWN;
+}
 
-static int battery_class_update(struct battery *b)
+static void parse_status(struct supply_values *v, const struct uevent_var *var)
 {
-	struct battery_class *ba = container_of(b, struct battery_class, battery);
-	int value, err, value_changed = 0;
-	struct fileaccess *file;
+	if (uevent_value_is(var, "Charging")) {
+		v->status = 1;
+		v->status_on_ac = 1;
+	} else if (uevent_value_is(var, "Discharging")) {
+		v->status = 0;
+		v->status_on_ac = 0;
+	} else if (uevent_value_is(var, "Full") ||
+		   uevent_value_is(var, "Not charging")) {
+		v->status = 0;
+		v->status_on_ac = 1;
+	}
+}
 
-	if (strempty(ba->ac_online_filename)) {
-		value = -1;
-	} else {
-		file = sysfs_file_open(O_RDONLY, ba->ac_online_filename);
-		if (!file) {
-			logerr("WARNING: Failed to open ac/online file\n");
-			return -ETXTBSY;
+static void parse_battery_uevent(struct supply_values *v,
+				 const char *buf, size_t len)
+{
+	static const struct {
+		const char *key;
+		size_t offset;
+	} int_keys[] = {
+		{ "POWER_SUPPLY_PRESENT", offsetof(struct supply_values, present), },
+		{ "POWER_SUPPLY_CAPACITY", offsetof(struct supply_values, capacity), },
+		{ "POWER_SUPPLY_CHARGE_FULL", offsetof(struct supply_values, charge_full), },
+		{ "POWER_SUPPLY_CHARGE_NOW", offsetof(struct supply_values, charge_now), },
+		{ "POWER_SUPPLY_ENERGY_FULL", offsetof(struct supply_values, energy_full), },
+		{ "POWER_SUPPLY_ENERGY_NOW", offsetof(struct supply_values, energy_now), },
+		{ "POWER_SUPPLY_CURRENT_NOW", offsetof(struct supply_values, current_now), },
+		{ "POWER_SUPPLY_POWER_NOW", offsetof(struct supply_values, power_now), },
+		{ "POWER_SUPPLY_VOLTAGE_NOW", offsetof(struct supply_values, voltage_now), },
+		{ "POWER_SUPPLY_VOLTAGE_MIN_DESIGN", offsetof(struct supply_values, voltage_min_design), },
+		{ "POWER_SUPPLY_TEMP", offsetof(struct supply_values, temp), },
+	};
+	struct uevent_iter it;
+	struct uevent_var var;
+	unsigned int i;
+	int value;
+
+	supply_values_init(v);
+	uevent_iter_init(&it, buf, len);
+	uevent_for_each_var(&var, &it) {
+		if (uevent_key_is(&var, "POWER_SUPPLY_STATUS")) {
+			parse_status(v, &var);
+			continue;
 		}
-		err = file_read_int(file, &value, 10);
-		file_close(file);
-		if (err) {
-			logerr("WARNING: Failed to read ac/online file\n");
-			return -ETXTBSY;
+		for (i = 0; i < ARRAY_SIZE(int_keys); i++) {
+			if (!uevent_key_is(&var, int_keys[i].key))
+				continue;
+			if (!uevent_value_int(&var, &value))
+				*(int *)((char *)v + int_keys[i].offset) = value;
+			break;
 		}
 	}
-	if (value != ba->on_ac) {
-		ba->on_ac = value;
-		value_changed = 1;
-	}
+}
 
-	value = 0;
-	file = sysfs_file_open(O_RDONLY, ba->charge_max_filename);
-	if (file) {
-		err = file_read_int(file, &value, 10);
-		file_close(file);
-		if (err) {
-			logerr("WARNING: Failed to read charge_max file\n");
-			return -ETXTBSY;
-		}
+static int read_ac_online(struct battery_class *ba, int *on_ac)
+{
+	char buf[UEVENT_BUF_SIZE];
+	struct uevent_iter it;
+	struct uevent_var var;
+	int count;
+
+	count = sysfs_attr_read_buf(&ba->ac_uevent_file,
+				    ba->ac_uevent_filename,
+				    buf, sizeof(buf));
+	if (count < 0)
+		return count;
+	uevent_iter_init(&it, buf, count);
+	uevent_for_each_var(&var, &it) {
+		if (uevent_key_is(&var, "POWER_SUPPLY_ONLINE"))
+			return uevent_value_int(&var, on_ac);
 	}
-	if (value != ba->charge_max) {
-		ba->charge_max = value;
-		value_changed = 1;
+
+	return -ENOENT;
+}
+
+static int read_battery(struct battery_class *ba, struct supply_values *v)
+{
+	char buf[UEVENT_BUF_SIZE];
+	int count;
+
+	count = sysfs_attr_read_buf(&ba->bat_uevent_file,
+				    ba->bat_uevent_filename,
+				    buf, sizeof(buf));
+	if (count < 0)
+		return count;
+	parse_battery_uevent(v, buf, count);
+
+	return 0;
+}
+
+static int battery_class_update(struct battery *b)
+{
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
+	struct supply_values v;
+	int on_ac, charge_max, charge_now;
+	int err, value_changed = 0;
+
+	err = read_battery(ba, &v);
+	if (err) {
+		logerr("WARNING: Failed to read battery uevent file\n");
+		return -ETXTBSY;
 	}
 
-	value = 0;
-	file = sysfs_file_open(O_RDONLY, ba->charge_now_filename);
-	if (file) {
-		err = file_read_int(file, &value, 10);
-		file_close(file);
+	if (strempty(ba->ac_uevent_filename)) {
+		on_ac = v.status_on_ac;
+	} else {
+		err = read_ac_online(ba, &on_ac);
 		if (err) {
-			logerr("WARNING: Failed to read charge_now file\n");
+			logerr("WARNING: Failed to read ac uevent file\n");
 			return -ETXTBSY;
 		}
 	}
-	value = min(value, ba->charge_max);
-	if (value != ba->charge_now) {
-		ba->charge_now = value;
-		value_changed = 1;
+
+	if (v.charge_full != VAL_UNKNOWN && v.charge_now != VAL_UNKNOWN) {
+		charge_max = v.charge_full;
+		charge_now = v.charge_now;
+	} else if (v.energy_full != VAL_UNKNOWN && v.energy_now != VAL_UNKNOWN) {
+		charge_max = v.energy_full;
+		charge_now = v.energy_now;
+	} else if (v.capacity != VAL_UNKNOWN) {
+		charge_max = 100;
+		charge_now = v.capacity;
+	} else {
+		charge_max = 0;
+		charge_now = 0;
 	}
+	if (!v.present)
+		charge_now = 0;
+	charge_now = clamp(charge_now, 0, charge_max);
+
+	if (on_ac != ba->on_ac ||
+	    v.status != ba->charging ||
+	    charge_max != ba->charge_max ||
+	    charge_now != ba->charge_now)
+		value_changed = 1;
+	ba->on_ac = on_ac;
+	ba->charging = v.status;
+	ba->charge_max = charge_max;
+	ba->charge_now = charge_now;
+
+	/* The measurements below change on every poll.
+	 * They don't trigger a state change notification. */
+	if (!v.present)
+		ba->capacity_mAh = 0;
+	else if (v.charge_full != VAL_UNKNOWN)
+		ba->capacity_mAh = v.charge_full / 1000;
+	else if (v.energy_full != VAL_UNKNOWN &&
+		 v.voltage_min_design != VAL_UNKNOWN && v.voltage_min_design > 0)
+		ba->capacity_mAh = (int64_t)v.energy_full * 1000 /
+				   v.voltage_min_design;
+	else
+		ba->capacity_mAh = -ENODEV;
+
+	if (v.current_now != VAL_UNKNOWN)
+		ba->current_mA = abs(v.current_now) / 1000;
+	else if (v.power_now != VAL_UNKNOWN &&
+		 v.voltage_now != VAL_UNKNOWN && v.voltage_now > 0)
+		ba->current_mA = (int64_t)abs(v.power_now) * 1000 /
+				 v.voltage_now;
+	else
+		ba->current_mA = -ENODEV;
+
+	if (v.temp != VAL_UNKNOWN)
+		ba->temperature_K = div_round(v.temp + 2732, 10);
+	else
+		ba->temperature_K = -ENODEV;
 
 	if (value_changed)
 		battery_notify_state_change(b);
@@ -94,6 +246,20 @@ static int battery_class_on_ac(struct battery *b)
 	return ba->on_ac;
 }
 
+static int battery_class_charging(struct battery *b)
+{
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
+
+	if (ba->charging >= 0)
+		return ba->charging;
+	/* No status reported. Guess it from the AC state. */
+	if (ba->on_ac < 0 || ba->charge_max <= 0)
+		return -1;
+
+	return ba->on_ac &&
+	       (int64_t)ba->charge_now * 100 < (int64_t)ba->charge_max * 95;
+}
+
 static int battery_class_max_level(struct battery *b)
 {
 	struct battery_class *ba = container_of(b, struct battery_class, battery);
@@ -108,135 +274,68 @@ static int battery_class_charge_level(struct battery *b)
 	return ba->charge_now;
 }
 
-static void battery_class_destroy(struct battery *b)
+static int battery_class_capacity_mAh(struct battery *b)
 {
 	struct battery_class *ba = container_of(b, struct battery_class, battery);
 
-	free(ba->ac_online_filename);
-	free(ba->charge_max_filename);
-	free(ba->charge_now_filename);
-
-	free(ba);
+	return ba->capacity_mAh;
 }
 
-static void find_ac_file(char *ac_file, size_t ac_file_size)
+static int battery_class_current_mA(struct battery *b)
 {
-	LIST_HEAD(dentries);
-	struct dir_entry *dentry;
-	int res, ok;
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
 
-	strncat(ac_file, BASEPATH, ac_file_size - strlen(ac_file) - 1);
+	return ba->current_mA;
+}
 
-	/* Find the AC-online file */
-	res = list_sysfs_directory(&dentries, ac_file);
-	if (res <= 0)
-		goto error;
-	ok = 0;
-	list_for_each_entry(dentry, &dentries, list) {
-		if ((dentry->type == DT_DIR ||
-		     dentry->type == DT_LNK) &&
-		    strncmp(dentry->name, "AC", 2) == 0) {
-			strncat(ac_file, "/", ac_file_size - strlen(ac_file) - 1);
-			strncat(ac_file, dentry->name, ac_file_size - strlen(ac_file) - 1);
-			strncat(ac_file, "/online", ac_file_size - strlen(ac_file) - 1);
-			ok = 1;
-			break;
-		}
-	}
-	dir_entries_free(&dentries);
-	if (!ok)
-		goto error;
+static int battery_class_temperature_K(struct battery *b)
+{
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
 
-	return;
-error:
-	ac_file[0] = '\0';
+	return ba->temperature_K;
 }
 
-static void find_battery_full_file(char *full_file, size_t full_file_size)
+static int battery_class_uevent_match(struct battery *b, const char *devpath)
 {
-	LIST_HEAD(dentries);
-	struct dir_entry *dentry;
-	int res, ok;
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
 
-	strncat(full_file, BASEPATH, full_file_size - strlen(full_file) - 1);
+	return battery_power_supply_match(devpath, ba->bat_uevent_filename) ||
+	       battery_power_supply_match(devpath, ba->ac_uevent_filename);
+}
 
-	/* Find the battery-full file */
-	res = list_sysfs_directory(&dentries, full_file);
-	if (res <= 0)
-		goto error;
-	ok = 0;
-	list_for_each_entry(dentry, &dentries, list) {
-		if ((dentry->type == DT_DIR ||
-		     dentry->type == DT_LNK) &&
-		    strncmp(dentry->name, "BAT", 3) == 0) {
-			strncat(full_file, "/", full_file_size - strlen(full_file) - 1);
-			strncat(full_file, dentry->name, full_file_size - strlen(full_file) - 1);
-			ok = 1;
-			break;
-		}
-	}
-	dir_entries_free(&dentries);
-	if (!ok)
-		goto error;
-	res = list_sysfs_directory(&dentries, full_file);
-	if (res <= 0)
-		goto error;
-	ok = 0;
-	list_for_each_entry(dentry, &dentries, list) {
-		if (dentry->type == DT_REG &&
-		    (strcmp(dentry->name, "charge_full") == 0 ||
-		     strcmp(dentry->name, "energy_full") == 0)) {
-			strncat(full_file, "/", full_file_size - strlen(full_file) - 1);
-			strncat(full_file, dentry->name, full_file_size - strlen(full_file) - 1);
-			ok = 1;
-			break;
-		}
-	}
-	dir_entries_free(&dentries);
-	if (!ok)
-		goto error;
+static void battery_class_destroy(struct battery *b)
+{
+	struct battery_class *ba = container_of(b, struct battery_class, battery);
 
-	return;
-error:
-	full_file[0] = '\0';
+	file_close(ba->ac_uevent_file);
+	file_close(ba->bat_uevent_file);
+	free(ba->ac_uevent_filename);
+	free(ba->bat_uevent_filename);
+
+	free(ba);
 }
 
-static void find_battery_now_file(char *now_file, size_t now_file_size)
+/* Find the uevent file of the first power supply with the name prefix. */
+static void find_uevent_file(const char *prefix,
+			     char *uevent_file, size_t uevent_file_size)
 {
 	LIST_HEAD(dentries);
 	struct dir_entry *dentry;
 	int res, ok;
 
-	strncat(now_file, BASEPATH, now_file_size - strlen(now_file) - 1);
+	strncat(uevent_file, BASEPATH, uevent_file_size - strlen(uevent_file) - 1);
 
-	/* Find the battery-now file */
-	res = list_sysfs_directory(&dentries, now_file);
+	res = list_sysfs_directory(&dentries, uevent_file);
 	if (res <= 0)
 		goto error;
 	ok = 0;
 	list_for_each_entry(dentry, &dentries, list) {
 		if ((dentry->type == DT_DIR ||
 		     dentry->type == DT_LNK) &&
-		    strncmp(dentry->name, "BAT", 3) == 0) {
-			strncat(now_file, "/", now_file_size - strlen(now_file) - 1);
-			strncat(now_file, dentry->name, now_file_size - strlen(now_file) - 1);
-			ok = 1;
-			break;
-		}
-	}
-	dir_entries_free(&dentries);
-	if (!ok)
-		goto error;
-	res = list_sysfs_directory(&dentries, now_file);
-	if (res <= 0)
-		goto error;
-	ok = 0;
-	list_for_each_entry(dentry, &dentries, list) {
-		if (dentry->type == DT_REG &&
-		    (strcmp(dentry->name, "charge_now") == 0 ||
-		     strcmp(dentry->name, "energy_now") == 0)) {
-			strncat(now_file, "/", now_file_size - strlen(now_file) - 1);
-			strncat(now_file, dentry->name, now_file_size - strlen(now_file) - 1);
+		    strncmp(dentry->name, prefix, strlen(prefix)) == 0) {
+			strncat(uevent_file, "/", uevent_file_size - strlen(uevent_file) - 1);
+			strncat(uevent_file, dentry->name, uevent_file_size - strlen(uevent_file) - 1);
+			strncat(uevent_file, "/uevent", uevent_file_size - strlen(uevent_file) - 1);
 			ok = 1;
 			break;
 		}
@@ -247,20 +346,19 @@ static void find_battery_now_file(char *now_file, size_t now_file_size)
 
 	return;
 error:
-	now_file[0] = '\0';
+	uevent_file[0] = '\0';
 }
 
 static struct battery * battery_class_probe(void)
 {
 	struct battery_class *ba;
+	struct supply_values v;
 	char ac_file[PATH_MAX + 1] = { 0, };
-	char full_file[PATH_MAX + 1] = { 0, };
-	char now_file[PATH_MAX + 1] = { 0, };
+	char bat_file[PATH_MAX + 1] = { 0, };
 
-	find_ac_file(ac_file, sizeof(ac_file));
-	find_battery_full_file(full_file, sizeof(full_file));
-	find_battery_now_file(now_file, sizeof(now_file));
-	if (strempty(full_file) || strempty(now_file))
+	find_uevent_file("AC", ac_file, sizeof(ac_file));
+	find_uevent_file("BAT", bat_file, sizeof(bat_file));
+	if (strempty(bat_file))
 		goto error;
 
 	ba = zalloc(sizeof(*ba));
@@ -271,15 +369,36 @@ static struct battery * battery_class_probe(void)
 	ba->battery.destroy = battery_class_destroy;
 	ba->battery.update = battery_class_update;
 	ba->battery.on_ac = battery_class_on_ac;
+	ba->battery.charging = battery_class_charging;
 	ba->battery.max_level = battery_class_max_level;
 	ba->battery.charge_level = battery_class_charge_level;
+	ba->battery.capacity_mAh = battery_class_capacity_mAh;
+	ba->battery.current_mA = battery_class_current_mA;
+	ba->battery.temperature_K = battery_class_temperature_K;
 	ba->battery.poll_interval = 10000;
-	ba->ac_online_filename = strdup(ac_file);
-	ba->charge_max_filename = strdup(full_file);
-	ba->charge_now_filename = strdup(now_file);
+	ba->battery.uevent_subsystem = "power_supply";
+	ba->battery.uevent_match = battery_class_uevent_match;
+	ba->on_ac = -1;
+	ba->charging = -1;
+	ba->ac_uevent_filename = strdup(ac_file);
+	ba->bat_uevent_filename = strdup(bat_file);
+	if (!ba->ac_uevent_filename || !ba->bat_uevent_filename)
+		goto err_free;
+
+	/* The battery must report a charge level. */
+	if (read_battery(ba, &v))
+		goto err_free;
+	if ((v.charge_full == VAL_UNKNOWN || v.charge_now == VAL_UNKNOWN) &&
+	    (v.energy_full == VAL_UNKNOWN || v.energy_now == VAL_UNKNOWN) &&
+	    v.capacity == VAL_UNKNOWN)
+		goto err_free;
+	if (!strempty(ac_file))
+		ba->ac_uevent_file = sysfs_file_open(O_RDONLY, "%s", ac_file);
 
 	return &ba->battery;
 
+err_free:
+	battery_class_destroy(&ba->battery);
 error:
 	return NULL;
 }
@@ -2,18 +2,26 @@
 #define BACKEND_BATTERY_CLASS_H_
 
 #include "battery.h"
+#include "fileaccess.h"
 
 
 struct battery_class {
 	struct battery battery;
 
 	int on_ac;
+	int charging;
 	int charge_max;
 	int charge_now;
+	int capacity_mAh;
+	int current_mA;
+	int temperature_K;
 
-	char *ac_online_filename;
-	char *charge_max_filename;
-	char *charge_now_filename;
+	char *ac_uevent_filename;
+	char *bat_uevent_filename;
+
+	/* Kept open between polls */
+	struct fileaccess *ac_uevent_file;
+	struct fileaccess *bat_uevent_file;
 };
 
 #endif /* BACKEND_BATTERY_CLASS_H_ */
@@ -15,6 +15,8 @@
 #include "devicelock.h"
 #include "log.h"
 
+#include <unistd.h>
+
 
 static void default_event(struct devicelock *s)
 {
@@ -44,9 +46,34 @@ void devicelock_destroy(struct devicelock *s)
 		s->destroy(s);
 }
 
+static void devicelock_fd_event(struct iowatch *w, uint32_t events)
+{
+	struct devicelock *s = container_of(w, struct devicelock, watch);
+	char buf[256];
+	ssize_t count;
+
+	do {
+		count = read(w->fd, buf, sizeof(buf));
+	} while (count > 0);
+
+	s->event(s);
+}
+
 void devicelock_init(struct devicelock *s, const char *name)
 {
 	memset(s, 0, sizeof(*s));
 	s->name = name;
 	s->event = default_event;
+	iowatch_init(&s->watch, "devicelock", devicelock_fd_event);
+}
+
+/* Call the event callback, if the (non-blocking) fd becomes readable. */
+int devicelock_watch_fd(struct devicelock *s, int fd)
+{
+	return iowatch_add(&s->watch, fd, EPOLLIN);
+}
+
+void devicelock_unwatch_fd(struct devicelock *s)
+{
+	iowatch_remove(&s->watch);
 }
@@ -2,6 +2,7 @@
 #define BACKEND_DEVICELOCK_H_
 
 #include "probe.h"
+#include "eventloop.h"
 
 
 struct devicelock {
@@ -9,12 +10,17 @@ struct devicelock {
 
 	void (*destroy)(struct devicelock *s);
 	void (*event)(struct devicelock *s);
+
+	/* Internal */
+	struct iowatch watch;
 };
 
 struct devicelock * devicelock_probe();
 void devicelock_destroy(struct devicelock *s);
 
 void devicelock_init(struct devicelock *s, const char *name);
+int devicelock_watch_fd(struct devicelock *s, int fd);
+void devicelock_unwatch_fd(struct devicelock *s);
 
 DECLARE_PROBES(devicelock);
 #define DEVICELOCK_PROBE(_name, _func)	DEFINE_PROBE(devicelock, _name, _func)
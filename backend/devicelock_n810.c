@@ -19,7 +19,6 @@
 
 #include <unistd.h>
 #include <fcntl.h>
-#include <signal.h>
 
 
 #define KB_BASEPATH	"/devices/platform/i2c_omap.2/i2c-2/2-0045"
@@ -85,6 +84,7 @@ static void devicelock_n810_destroy(struct devicelock *s)
 {
 	struct devicelock_n810 *sn = container_of(s, struct devicelock_n810, devicelock);
 
+	devicelock_unwatch_fd(s);
 	close(sn->kb_lock_evdev_fd);
 	file_close(sn->kb_lock_state_file);
 	file_close(sn->kb_disable_file);
@@ -139,14 +139,9 @@ static struct devicelock * devicelock_n810_probe(void)
 	if (kb_lock_evdev < 0)
 		goto err_close;
 	snprintf(buf, sizeof(buf), "/dev/input/event%u", kb_lock_evdev);
-	kb_lock_evdev_fd = open(buf, O_RDONLY);
+	kb_lock_evdev_fd = open(buf, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
 	if (kb_lock_evdev_fd < 0)
 		goto err_close;
-	err = fcntl(kb_lock_evdev_fd, F_SETFL, O_ASYNC | O_NONBLOCK);
-	err |= fcntl(kb_lock_evdev_fd, F_SETSIG, SIGUSR2);
-	err |= fcntl(kb_lock_evdev_fd, F_SETOWN, getpid());
-	if (err)
-		goto err_close;
 
 	sn = zalloc(sizeof(*sn));
 	if (!sn)
@@ -159,13 +154,18 @@ static struct devicelock * devicelock_n810_probe(void)
 	devicelock_init(&sn->devicelock, "n810");
 	sn->devicelock.event = devicelock_n810_event;
 	sn->devicelock.destroy = devicelock_n810_destroy;
+	err = devicelock_watch_fd(&sn->devicelock, kb_lock_evdev_fd);
+	if (err) {
+		free(sn);
+		goto err_close;
+	}
 
 	logdebug("Screenlock toggle on %s\n", buf);
 
 	return &sn->devicelock;
 
 err_close:
-	if (kb_lock_evdev_fd)
+	if (kb_lock_evdev_fd >= 0)
 		close(kb_lock_evdev_fd);
 	file_close(kb_lock_state);
 	file_close(ts_disable);
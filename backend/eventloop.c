@@ -0,0 +1,150 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "eventloop.h"
+#include "log.h"
+#include "util.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+
+#define EVENTLOOP_MAX_EVENTS	32
+
+
+static int epoll_fd = -1;
+
+/* The batch of events currently being dispatched.
+ * Watches removed during dispatch are cleared from it. */
+static struct epoll_event pending_events[EVENTLOOP_MAX_EVENTS];
+static int nr_pending_events;
+
+
+void iowatch_init(struct iowatch *w,
+		  const char *name,
+		  iowatch_callback_t callback)
+{
+	memset(w, 0, sizeof(*w));
+	w->name = name;
+	w->fd = -1;
+	w->callback = callback;
+}
+
+int iowatch_add(struct iowatch *w, int fd, uint32_t events)
+{
+	struct epoll_event ev;
+	int err;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	if (err) {
+		logerr("eventloop: Failed to add %s (fd=%d): %s\n",
+		       w->name, fd, strerror(errno));
+		return -errno;
+	}
+	w->fd = fd;
+	w->events = events;
+	logverbose("eventloop: %s (fd=%d) added\n", w->name, fd);
+
+	return 0;
+}
+
+int iowatch_modify(struct iowatch *w, uint32_t events)
+{
+	struct epoll_event ev;
+	int err;
+
+	if (!iowatch_active(w))
+		return -EINVAL;
+	if (w->events == events)
+		return 0;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, w->fd, &ev);
+	if (err) {
+		logerr("eventloop: Failed to modify %s (fd=%d): %s\n",
+		       w->name, w->fd, strerror(errno));
+		return -errno;
+	}
+	w->events = events;
+
+	return 0;
+}
+
+void iowatch_remove(struct iowatch *w)
+{
+	int i;
+
+	if (!iowatch_active(w))
+		return;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+	for (i = 0; i < nr_pending_events; i++) {
+		if (pending_events[i].data.ptr == w)
+			pending_events[i].data.ptr = NULL;
+	}
+	logverbose("eventloop: %s (fd=%d) removed\n", w->name, w->fd);
+	w->fd = -1;
+	w->events = 0;
+}
+
+int eventloop_init(void)
+{
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		logerr("eventloop: Failed to create epoll instance: %s\n",
+		       strerror(errno));
+		return -errno;
+	}
+
+	return 0;
+}
+
+void eventloop_exit(void)
+{
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+int eventloop_wait(int timeout_msec)
+{
+	struct iowatch *w;
+	int i, count;
+
+	count = epoll_wait(epoll_fd, pending_events,
+			   ARRAY_SIZE(pending_events), timeout_msec);
+	if (count < 0) {
+		if (errno == EINTR)
+			return 0;
+		return -errno;
+	}
+
+	nr_pending_events = count;
+	for (i = 0; i < nr_pending_events; i++) {
+		w = pending_events[i].data.ptr;
+		if (!w)
+			continue; /* Removed during dispatch */
+		w->callback(w, pending_events[i].events);
+	}
+	nr_pending_events = 0;
+
+	return count;
+}
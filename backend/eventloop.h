@@ -0,0 +1,35 @@
+#ifndef BACKEND_EVENTLOOP_H_
+#define BACKEND_EVENTLOOP_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+
+struct iowatch;
+
+typedef void (*iowatch_callback_t)(struct iowatch *w, uint32_t events);
+
+struct iowatch {
+	const char *name;
+	int fd;
+	uint32_t events;
+	iowatch_callback_t callback;
+};
+
+void iowatch_init(struct iowatch *w,
+		  const char *name,
+		  iowatch_callback_t callback);
+int iowatch_add(struct iowatch *w, int fd, uint32_t events);
+int iowatch_modify(struct iowatch *w, uint32_t events);
+void iowatch_remove(struct iowatch *w);
+
+static inline int iowatch_active(const struct iowatch *w)
+{
+	return w->fd >= 0;
+}
+
+int eventloop_init(void);
+void eventloop_exit(void);
+int eventloop_wait(int timeout_msec);
+
+#endif /* BACKEND_EVENTLOOP_H_ */
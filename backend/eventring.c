@@ -0,0 +1,121 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "eventring.h"
+#include "shm.h"
+#include "log.h"
+
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+
+static struct shm_area ring_area = { .fd = -1, };
+static struct pt_event_ring *ring;
+/* Number of connected clients, that requested the ring. */
+static unsigned int nr_readers;
+
+
+static void eventring_wake(void)
+{
+	syscall(SYS_futex, &ring->head, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/* Publish a notification to all ring readers.
+ * The cost does not depend on the number of readers. */
+void eventring_publish(const struct pt_message *msg)
+{
+	struct pt_event_slot *slot;
+	uint32_t pos;
+
+	if (!ring)
+		return;
+
+	pos = ring->head;
+	slot = &ring->slots[pos % PT_EVENT_RING_SLOTS];
+
+	/* Invalidate the slot for readers that are still reading it. */
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->msg = *msg;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, pos + 1, __ATOMIC_RELEASE);
+
+	/* The readers map the ring read-only and cannot announce
+	 * themselves in the ring. Only wake, if a client, that
+	 * requested the ring, is connected. */
+	if (nr_readers)
+		eventring_wake();
+}
+
+/* Get a new read-only file descriptor for the ring.
+ * The caller must close it. */
+int eventring_get_fd(void)
+{
+	/* Never hand out a ring, that clients could write to. */
+	if (!ring_area.sealed)
+		return -EPERM;
+
+	return shm_area_get_readonly_fd(&ring_area);
+}
+
+void eventring_reader_add(void)
+{
+	nr_readers++;
+}
+
+void eventring_reader_remove(void)
+{
+	if (nr_readers)
+		nr_readers--;
+}
+
+/* Retire the ring before a takeover. The ring is sealed and can not be
+ * written by the next instance. So the readers are woken up and have to
+ * request a new ring. Called with retire=0, if the takeover failed. */
+void eventring_retire(int retire)
+{
+	if (!ring)
+		return;
+
+	__atomic_store_n(&ring->magic, retire ? 0 : PT_EVENT_RING_MAGIC,
+			 __ATOMIC_RELEASE);
+	if (retire)
+		eventring_wake();
+}
+
+int eventring_init(void)
+{
+	int err;
+
+	err = shm_area_create(&ring_area, "pwrtray-events", sizeof(*ring));
+	if (err)
+		return err;
+	ring = ring_area.mem;
+	ring->magic = PT_EVENT_RING_MAGIC;
+	ring->nr_slots = PT_EVENT_RING_SLOTS;
+	shm_area_seal(&ring_area);
+
+	return 0;
+}
+
+void eventring_exit(void)
+{
+	ring = NULL;
+	nr_readers = 0;
+	shm_area_destroy(&ring_area);
+}
@@ -0,0 +1,17 @@
+#ifndef BACKEND_EVENTRING_H_
+#define BACKEND_EVENTRING_H_
+
+#include "api.h"
+
+
+int eventring_init(void);
+void eventring_exit(void);
+
+int eventring_get_fd(void);
+void eventring_reader_add(void);
+void eventring_reader_remove(void);
+void eventring_retire(int retire);
+
+void eventring_publish(const struct pt_message *msg);
+
+#endif /* BACKEND_EVENTRING_H_ */
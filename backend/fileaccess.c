@@ -30,17 +30,13 @@
 #define SYSFS_BASE	"/sys"
 
 
-static void file_rewind(struct fileaccess *fa)
-{
-	rewind(fa->stream);
-	lseek(fa->fd, 0, SEEK_SET);
-}
-
 void file_close(struct fileaccess *fa)
 {
 	if (fa) {
-		fclose(fa->stream);
-		close(fa->fd);
+		if (fa->stream)
+			fclose(fa->stream);
+		else
+			close(fa->fd);
 		free(fa);
 	}
 }
@@ -50,44 +46,45 @@ struct fileaccess * file_open(int flags, const char *path_fmt, ...)
 	char path[PATH_MAX + 1];
 	va_list ap;
 	int fd;
-	FILE *stream;
 	struct fileaccess *fa;
-	const char *opentype;
+
+	if (flags != O_RDONLY && flags != O_WRONLY && flags != O_RDWR)
+		return NULL;
 
 	va_start(ap, path_fmt);
 	vsnprintf(path, sizeof(path), path_fmt, ap);
 	va_end(ap);
 
-	fd = open(path, flags);
+	fd = open(path, flags | O_CLOEXEC);
 	if (fd < 0)
-		goto error;
-	if (flags == O_RDONLY)
-		opentype = "r";
-	else if (flags == O_WRONLY)
-		opentype = "w";
-	else if (flags == O_RDWR)
-		opentype = "w+";
-	else
-		goto err_close;
-	stream = fdopen(fd, opentype);
-	if (!stream)
-		goto err_close;
-
+		return NULL;
 	fa = zalloc(sizeof(*fa));
-	if (!fa)
-		goto err_fclose;
-
+	if (!fa) {
+		close(fd);
+		return NULL;
+	}
 	fa->fd = fd;
-	fa->stream = stream;
+	fa->flags = flags;
 
 	return fa;
+}
 
-err_fclose:
-	fclose(stream);
-err_close:
-	close(fd);
-error:
-	return NULL;
+/* Get the stdio stream for line based reading. */
+static FILE * file_stream(struct fileaccess *fa)
+{
+	const char *opentype;
+
+	if (fa->stream)
+		return fa->stream;
+	if (fa->flags == O_RDONLY)
+		opentype = "r";
+	else if (fa->flags == O_WRONLY)
+		opentype = "w";
+	else
+		opentype = "w+";
+	fa->stream = fdopen(fa->fd, opentype);
+
+	return fa->stream;
 }
 
 struct fileaccess * sysfs_file_open(int flags, const char *path_fmt, ...)
@@ -114,6 +111,8 @@ struct fileaccess * procfs_file_open(int flags, const char *path_fmt, ...)
 	return file_open(flags, "%s/%s", PROCFS_BASE, path);
 }
 
+/* Read the file from the start. The file offset is not used,
+ * so a file can be kept open and re-read. */
 int file_read_buf(struct fileaccess *fa, char *buf, size_t size)
 {
 	ssize_t count;
@@ -122,15 +121,17 @@ int file_read_buf(struct fileaccess *fa, char *buf, size_t size)
 	if (!size)
 		return 0;
 
-	file_rewind(fa);
 	while (size) {
-		count = read(fa->fd, buf + pos, size);
+		count = pread(fa->fd, buf + pos, size, pos);
 		if (count < 0)
 			return -errno;
 		if (!count)
 			break;
 		size -= count;
 		pos += count;
+		/* sysfs attributes are returned by a single read. */
+		if (size)
+			break;
 	}
 
 	return pos;
@@ -150,53 +151,120 @@ int file_read_string(struct fileaccess *fa, char *buf, size_t size)
 	return count;
 }
 
+/* Format an integer like snprintf() with "%d" or "0x%X".
+ * Returns the length. The buffer is not NUL terminated. */
+static size_t format_int(char *buf, int value, int base)
+{
+	char digits[sizeof(int) * 8];
+	unsigned int uval = (unsigned int)value;
+	unsigned int digit;
+	size_t len = 0, count = 0;
+
+	if (base == 16) {
+		buf[len++] = '0';
+		buf[len++] = 'x';
+	} else if (value < 0) {
+		buf[len++] = '-';
+		uval = -uval;
+	}
+	do {
+		digit = uval % base;
+		digits[count++] = (digit < 10) ? ('0' + digit) : ('A' + digit - 10);
+		uval /= base;
+	} while (uval);
+	while (count)
+		buf[len++] = digits[--count];
+
+	return len;
+}
+
 int file_read_int(struct fileaccess *fa, int *value, int base)
 {
 	char buf[64];
 	int count;
-	long val;
-	char *tail;
 
-	count = file_read_buf(fa, buf, sizeof(buf) - 1);
+	count = file_read_buf(fa, buf, sizeof(buf));
 	if (count < 0)
 		return count;
-	buf[count] = '\0';
 
-	errno = 0;
-	val = strtol(buf, &tail, base);
-	if (errno || (*tail != '\0' && *tail != '\n'))
+	if (parse_int(buf, count, base, value))
 		return -ETXTBSY;
-	*value = val;
 
 	return 0;
 }
 
+/* Read a sysfs attribute, that is kept open between reads.
+ * The attribute is (re)opened, if it is not open, yet, or if reading
+ * failed, e.g. because the device was removed and added again.
+ * Returns the number of bytes read or -ENOENT,
+ * if the attribute can not be opened. */
+int sysfs_attr_read_buf(struct fileaccess **file, const char *path,
+			char *buf, size_t size)
+{
+	int count;
+
+	if (*file) {
+		count = file_read_buf(*file, buf, size);
+		if (count >= 0)
+			return count;
+		file_close(*file);
+		*file = NULL;
+	}
+	*file = sysfs_file_open(O_RDONLY, "%s", path);
+	if (!*file)
+		return -ENOENT;
+	count = file_read_buf(*file, buf, size);
+	if (count < 0) {
+		file_close(*file);
+		*file = NULL;
+	}
+
+	return count;
+}
+
+/* Read an integer from a sysfs attribute, that is kept open between reads.
+ * See sysfs_attr_read_buf(). */
+int sysfs_attr_read_int(struct fileaccess **file, const char *path,
+			int *value, int base)
+{
+	int err;
+
+	if (*file) {
+		err = file_read_int(*file, value, base);
+		if (!err)
+			return 0;
+		file_close(*file);
+		*file = NULL;
+	}
+	*file = sysfs_file_open(O_RDONLY, "%s", path);
+	if (!*file)
+		return -ENOENT;
+	err = file_read_int(*file, value, base);
+	if (err) {
+		file_close(*file);
+		*file = NULL;
+	}
+
+	return err;
+}
+
 int file_write_int(struct fileaccess *fa, int value, int base)
 {
 	char buf[64];
-	const char *buf_ptr;
-	const char *fmt;
-	size_t count;
+	size_t count, pos = 0;
 	ssize_t res;
 
-	if (base == 0 || base == 10)
-		fmt = "%d";
-	else if (base == 16)
-		fmt = "0x%X";
-	else
+	if (base == 0)
+		base = 10;
+	if (base != 10 && base != 16)
 		return -EINVAL;
 
-	snprintf(buf, sizeof(buf), fmt, value);
-
-	file_rewind(fa);
-	count = strlen(buf);
-	buf_ptr = buf;
-	while (count) {
-		res = write(fa->fd, buf_ptr, count);
+	count = format_int(buf, value, base);
+	while (pos < count) {
+		res = pwrite(fa->fd, buf + pos, count - pos, pos);
 		if (res < 0)
 			return -ETXTBSY;
-		count -= (size_t)res;
-		buf_ptr += (size_t)res;
+		pos += (size_t)res;
 	}
 
 	return 0;
@@ -228,12 +296,16 @@ int file_read_text_lines(struct fileaccess *fa, struct list_head *lines_list,
 	size_t size = 0;
 	ssize_t count;
 	struct text_line *tl;
+	FILE *stream;
 	int err;
 
 	INIT_LIST_HEAD(lines_list);
-	file_rewind(fa);
+	stream = file_stream(fa);
+	if (!stream)
+		return -errno;
+	rewind(stream);
 	while (1) {
-		count = getline(&lineptr, &size, fa->stream);
+		count = getline(&lineptr, &size, stream);
 		if (count <= 0)
 			break;
 		while (count > 0 &&
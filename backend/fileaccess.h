@@ -11,7 +11,8 @@
 
 struct fileaccess {
 	int fd;
-	FILE *stream;
+	int flags;	/* O_... */
+	FILE *stream;	/* Only for line based reading. Created on demand. */
 };
 
 void file_close(struct fileaccess *fa);
@@ -24,6 +25,10 @@ int file_read_string(struct fileaccess *fa, char *buf, size_t size);
 int file_read_int(struct fileaccess *fa, int *value, int base);
 int file_write_int(struct fileaccess *fa, int value, int base);
 int file_read_bool(struct fileaccess *fa, int *value);
+int sysfs_attr_read_buf(struct fileaccess **file, const char *path,
+			char *buf, size_t size);
+int sysfs_attr_read_int(struct fileaccess **file, const char *path,
+			int *value, int base);
 int file_write_bool(struct fileaccess *fa, int value);
 
 struct text_line {
@@ -0,0 +1,143 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "inputdev.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+
+#define BITS_PER_LONG		(sizeof(long) * 8)
+#define NR_LONGS(nr_bits)	div_round_up(nr_bits, BITS_PER_LONG)
+
+static inline int test_bit(unsigned int bit, const unsigned long *bits)
+{
+	return !!(bits[bit / BITS_PER_LONG] & (1UL << (bit % BITS_PER_LONG)));
+}
+
+static int test_bit_range(unsigned int first, unsigned int last,
+			  const unsigned long *bits)
+{
+	unsigned int bit;
+
+	for (bit = first; bit <= last; bit++) {
+		if (test_bit(bit, bits))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Only the evdev nodes are used. The legacy mouseN, mice and jsN
+ * nodes deliver duplicates of the same events. */
+int inputdev_is_event_node(const char *name)
+{
+	unsigned int nr;
+	char c;
+
+	return sscanf(name, "event%u%c", &nr, &c) == 1;
+}
+
+/* Get the identification and the capability classes of an evdev device.
+ * Returns a negative error code, if this is not an evdev device. */
+int inputdev_probe(int fd, struct inputdev_info *info)
+{
+	unsigned long evbits[NR_LONGS(EV_CNT)];
+	unsigned long keybits[NR_LONGS(KEY_CNT)];
+	unsigned long relbits[NR_LONGS(REL_CNT)];
+	unsigned long absbits[NR_LONGS(ABS_CNT)];
+	unsigned long propbits[NR_LONGS(INPUT_PROP_CNT)];
+	struct input_id id;
+
+	memset(info, 0, sizeof(*info));
+	memset(evbits, 0, sizeof(evbits));
+	memset(keybits, 0, sizeof(keybits));
+	memset(relbits, 0, sizeof(relbits));
+	memset(absbits, 0, sizeof(absbits));
+	memset(propbits, 0, sizeof(propbits));
+
+	if (ioctl(fd, EVIOCGBIT(0, sizeof(evbits)), evbits) < 0)
+		return -errno;
+	if (ioctl(fd, EVIOCGID, &id) == 0) {
+		info->vendor = id.vendor;
+		info->product = id.product;
+	}
+	if (ioctl(fd, EVIOCGNAME(sizeof(info->name) - 1), info->name) < 0)
+		info->name[0] = '\0';
+	/* The property bits are not supported by old kernels. */
+	ioctl(fd, EVIOCGPROP(sizeof(propbits)), propbits);
+
+	if (test_bit(EV_KEY, evbits))
+		ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(keybits)), keybits);
+	if (test_bit(EV_REL, evbits))
+		ioctl(fd, EVIOCGBIT(EV_REL, sizeof(relbits)), relbits);
+	if (test_bit(EV_ABS, evbits))
+		ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(absbits)), absbits);
+
+	/* Real keyboards have (some of) the main block keys.
+	 * Power buttons, lid switches and hotkey devices do not. */
+	if (test_bit_range(KEY_ESC, KEY_KPDOT, keybits))
+		info->classes |= INPUTDEV_KEYBOARD;
+
+	if (test_bit(REL_X, relbits) && test_bit(REL_Y, relbits))
+		info->classes |= INPUTDEV_POINTER;
+	if (test_bit(ABS_X, absbits) && test_bit(ABS_Y, absbits) &&
+	    !test_bit(INPUT_PROP_ACCELEROMETER, propbits)) {
+		if (test_bit(BTN_TOUCH, keybits) ||
+		    test_bit(BTN_LEFT, keybits) ||
+		    test_bit(BTN_TOOL_FINGER, keybits) ||
+		    test_bit(BTN_STYLUS, keybits))
+			info->classes |= INPUTDEV_POINTER;
+		else if (test_bit_range(BTN_JOYSTICK, BTN_THUMBR, keybits))
+			info->classes |= INPUTDEV_JOYSTICK;
+	}
+
+	return 0;
+}
+
+/* Match the device against a comma separated list of fnmatch(3)
+ * patterns. Each pattern is compared to the device name and to the
+ * "vvvv:pppp" hexadecimal vendor:product ID. */
+int inputdev_match(const struct inputdev_info *info, const char *patterns)
+{
+	char *string, *s, *next;
+	char id[10];
+	int match = 0;
+
+	if (!patterns || strempty(patterns))
+		return 0;
+	string = strdup(patterns);
+	if (!string)
+		return 0;
+	snprintf(id, sizeof(id), "%04x:%04x", info->vendor, info->product);
+
+	for (s = string; s && !match; s = next) {
+		next = strchr(s, ',');
+		if (next)
+			*next++ = '\0';
+		s = string_strip(s);
+		if (strempty(s))
+			continue;
+		match = (fnmatch(s, info->name, 0) == 0 ||
+			 fnmatch(s, id, FNM_CASEFOLD) == 0);
+	}
+	free(string);
+
+	return match;
+}
@@ -0,0 +1,29 @@
+#ifndef BACKEND_INPUTDEV_H_
+#define BACKEND_INPUTDEV_H_
+
+#include <stdint.h>
+
+
+/* Input device capability classes */
+enum inputdev_class {
+	INPUTDEV_KEYBOARD	= (1 << 0),
+	INPUTDEV_POINTER	= (1 << 1),	/* Mouse, touchpad, touchscreen */
+	INPUTDEV_JOYSTICK	= (1 << 2),
+};
+
+/* Classes of devices that are operated by a human. */
+#define INPUTDEV_HUMAN		(INPUTDEV_KEYBOARD | INPUTDEV_POINTER | \
+				 INPUTDEV_JOYSTICK)
+
+struct inputdev_info {
+	char name[128];
+	uint16_t vendor;
+	uint16_t product;
+	unsigned int classes;	/* enum inputdev_class */
+};
+
+int inputdev_is_event_node(const char *name);
+int inputdev_probe(int fd, struct inputdev_info *info);
+int inputdev_match(const struct inputdev_info *info, const char *patterns);
+
+#endif /* BACKEND_INPUTDEV_H_ */
@@ -40,7 +40,9 @@ static void write_log(FILE *fd, int prio, const char *fmt, va_list args)
 void log_initialize(void)
 {
 	if (cmdargs.logfile) {
-		log_fd = fopen(cmdargs.logfile, "w+");
+		/* Continue the log of the previous backend on takeover. */
+		log_fd = fopen(cmdargs.logfile,
+			       (cmdargs.takeover_fd >= 0) ? "ae" : "w+e");
 		if (!log_fd)
 			logerr("Failed to open logfile: %s\n", cmdargs.logfile);
 	}
@@ -51,6 +53,7 @@ void log_exit(void)
 	if (log_fd)
 		fclose(log_fd);
 	log_fd = NULL;
+	closelog();
 }
 
 void loginfo(const char *fmt, ...)
@@ -24,6 +24,11 @@
 #include "backlight.h"
 #include "devicelock.h"
 #include "autodim.h"
+#include "eventloop.h"
+#include "statepage.h"
+#include "eventring.h"
+#include "takeover.h"
+#include "uevent.h"
 
 #include <assert.h>
 #include <stdio.h>
@@ -33,49 +38,336 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
-#include <sys/ioctl.h>
+#include <poll.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <sys/resource.h>
 
 
+/* Maximum number of queued outgoing messages per client.
+ * Notifications are coalesced, so this is only reached
+ * if a client does not read its replies. */
+#define CLIENT_TXQUEUE_LEN	32
+
+/* Maximum number of connections accepted per listener and loop iteration. */
+#define ACCEPT_BATCH		32
+
+/* Maximum number of v1 messages or v2 frames received from
+ * one client per loop iteration. */
+#define CLIENT_RX_BUDGET	16
+
+/* An outgoing v1 message or v2 frame. */
+struct client_txbuf {
+	uint16_t id;		/* Message ID for coalescing, or 0xFFFF */
+	uint16_t size;
+	int fd;			/* File descriptor to pass, or -1 */
+	uint8_t data[PT_FRAME_MAX_SIZE];
+};
+
 struct client {
 	int fd;
+	unsigned int version;	/* Protocol version */
+	int hello_done;
 	int notifications_enabled;
+	uint32_t notify_mask;		/* PT_NOTIFY_... */
+	uint32_t notify_predicates;	/* PT_NOTIFY_PRED_... */
+	/* The last notifications sent to the client, for the predicates. */
+	struct pt_message last_bl;
+	struct pt_message last_bat;
+	int tx_failed;
+	int ring_reader;	/* Requested the event ring */
+	struct iowatch watch;
+	/* Request rate limit token bucket, in 1/1000 requests */
+	long rx_tokens;
+	struct timespec rx_refill;
+	int throttled;
+	struct sleeptimer throttle_timer;
+	/* Deferred PTREQ_BL_SETBRIGHTNESS. Consecutive requests
+	 * are collapsed to the latest one. */
+	int bl_pending;
+	int32_t bl_brightness;
+	uint16_t bl_tag;
+	struct pt_message bl_reply;
+	/* v1 receive buffer */
+	struct pt_message rxbuf;
+	size_t rxpos;
+	/* v2 reply frame of the currently processed request frame */
+	int in_frame;
+	uint16_t rx_tag;	/* Tag of the currently processed request */
+	struct client_txbuf txframe;
+	/* Ring buffer of outgoing messages. */
+	struct client_txbuf txqueue[CLIENT_TXQUEUE_LEN];
+	unsigned int tx_head;
+	unsigned int tx_count;
+	size_t txpos;	/* Already sent bytes of the head message */
 	struct list_head list;
 };
 
-static int socket_fd = -1;
-static sig_atomic_t in_signal;
-static int sig_block_count;
+struct listener {
+	const char *path;
+	int type;		/* SOCK_... */
+	unsigned int version;	/* Protocol version */
+	int fd;
+	struct iowatch watch;
+};
+
+static struct listener listeners[] = {
+	{ .path = PT_SOCKET,	.type = SOCK_STREAM,	.version = 1, .fd = -1, },
+	{ .path = PT_SOCKET_V2,	.type = SOCK_SEQPACKET,	.version = 2, .fd = -1, },
+};
+
+static unsigned int listen_backlog;
+static unsigned int client_rate;	/* Requests per second. 0 = unlimited */
+static unsigned int client_burst;
+
+static int signal_fd = -1;
+static struct iowatch signal_watch;
+static int terminate;
+static int reexec;
+static char **saved_argv;
 static LIST_HEAD(client_list);
 
 struct backend backend;
 
 
-static int send_message(struct client *c, struct pt_message *msg, uint16_t flags)
+/* Stop talking to a broken client. It is removed from the
+ * event loop, when it reports the hangup caused by the shutdown. */
+static void client_txbuf_release(struct client_txbuf *buf)
+{
+	if (buf->fd >= 0) {
+		close(buf->fd);
+		buf->fd = -1;
+	}
+}
+
+static void client_drop_txqueue(struct client *c)
+{
+	while (c->tx_count) {
+		client_txbuf_release(&c->txqueue[c->tx_head]);
+		c->tx_head = (c->tx_head + 1) % CLIENT_TXQUEUE_LEN;
+		c->tx_count--;
+	}
+	c->txpos = 0;
+	client_txbuf_release(&c->txframe);
+	c->txframe.size = 0;
+}
+
+static void client_fail(struct client *c)
+{
+	c->tx_failed = 1;
+	client_drop_txqueue(c);
+	shutdown(c->fd, SHUT_RDWR);
+}
+
+/* Send a buffer with the attached file descriptor. */
+static ssize_t client_send_fd(struct client *c, struct client_txbuf *buf)
 {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov = {
+		.iov_base	= buf->data,
+		.iov_len	= buf->size,
+	};
+	struct msghdr mh = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= control.buf,
+		.msg_controllen	= sizeof(control.buf),
+	};
+	struct cmsghdr *cmsg;
+
+	memset(&control, 0, sizeof(control));
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &buf->fd, sizeof(int));
+
+	return sendmsg(c->fd, &mh, MSG_NOSIGNAL);
+}
+
+static void client_update_events(struct client *c)
+{
+	uint32_t events = 0;
+
+	if (!c->throttled)
+		events |= EPOLLIN;
+	if (c->tx_count)
+		events |= EPOLLOUT;
+	iowatch_modify(&c->watch, events);
+}
+
+static int client_flush(struct client *c)
+{
+	struct client_txbuf *buf;
 	ssize_t ret;
-	size_t count, pos = 0;
 
-	msg->flags |= htons(flags);
-	count = sizeof(*msg);
-	while (count) {
-		ret = send(c->fd, ((uint8_t *)msg) + pos, count, 0);
+	while (c->tx_count) {
+		buf = &c->txqueue[c->tx_head];
+		if (buf->fd >= 0 && c->txpos == 0) {
+			ret = client_send_fd(c, buf);
+		} else {
+			ret = send(c->fd, buf->data + c->txpos,
+				   buf->size - c->txpos, MSG_NOSIGNAL);
+		}
 		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
 			logerr("Failed to send message to client, fd=%d\n",
 			       c->fd);
-			return -1;
+			client_fail(c);
+			break;
+		}
+		c->txpos += ret;
+		if (buf->fd >= 0 && ret > 0)
+			client_txbuf_release(buf);
+		if (c->txpos == buf->size) {
+			c->txpos = 0;
+			c->tx_head = (c->tx_head + 1) % CLIENT_TXQUEUE_LEN;
+			c->tx_count--;
 		}
-		count -= ret;
-		pos += ret;
 	}
+	/* Wait for the socket to become writable, if anything is left. */
+	client_update_events(c);
 
-	return 0;
+	return c->tx_failed ? -1 : 0;
 }
 
-static int enable_autodim(int max_percent, int enable_on_ac)
+/* Remove the queued buffer with the ID, if it is not partially sent, yet,
+ * and does not carry a file descriptor. The buffers behind it move up. */
+static void client_txqueue_remove_id(struct client *c, uint16_t id)
+{
+	unsigned int i, index, next;
+
+	for (i = 0; i < c->tx_count; i++) {
+		index = (c->tx_head + i) % CLIENT_TXQUEUE_LEN;
+		if (c->txqueue[index].id != id || c->txqueue[index].fd >= 0)
+			continue;
+		if (i == 0 && c->txpos)
+			continue;
+		for (; i + 1 < c->tx_count; i++) {
+			next = (index + 1) % CLIENT_TXQUEUE_LEN;
+			c->txqueue[index] = c->txqueue[next];
+			index = next;
+		}
+		c->tx_count--;
+		return;
+	}
+}
+
+/* Queue a message or frame for sending and try to send it right away.
+ * The ownership of an attached file descriptor is passed to the queue.
+ * If the buffer ID is coalescable, an older queued buffer with the same ID
+ * is dropped and the new one is queued at the tail. That keeps the order
+ * of the messages and limits the queue to one buffer per notification. */
+static int client_queue(struct client *c, struct client_txbuf *txbuf)
+{
+	unsigned int index;
+	struct client_txbuf *buf;
+
+	if (c->tx_failed) {
+		client_txbuf_release(txbuf);
+		return -1;
+	}
+
+	if (txbuf->id != 0xFFFF && txbuf->fd < 0)
+		client_txqueue_remove_id(c, txbuf->id);
+	if (c->tx_count >= CLIENT_TXQUEUE_LEN) {
+		logerr("Client transmit queue overflow, fd=%d\n", c->fd);
+		client_txbuf_release(txbuf);
+		client_fail(c);
+		return -1;
+	}
+	index = (c->tx_head + c->tx_count) % CLIENT_TXQUEUE_LEN;
+	buf = &c->txqueue[index];
+	buf->id = txbuf->id;
+	buf->size = txbuf->size;
+	buf->fd = txbuf->fd;
+	txbuf->fd = -1;
+	memcpy(buf->data, txbuf->data, txbuf->size);
+	c->tx_count++;
+
+	return client_flush(c);
+}
+
+/* Queue the v2 reply frame, if there are any records in it. */
+static int client_commit_frame(struct client *c)
+{
+	int err = 0;
+
+	if (c->txframe.size)
+		err = client_queue(c, &c->txframe);
+	c->txframe.size = 0;
+
+	return err;
+}
+
+/* Queue a message. The ownership of fd (if not -1) is passed. */
+static int client_queue_message(struct client *c, const struct pt_message *msg,
+				int coalesce, int fd)
+{
+	struct client_txbuf txbuf;
+	uint16_t tag = 0;
+	size_t size;
+
+	if (c->version < 2) {
+		txbuf.id = coalesce ? msg->id : 0xFFFF;
+		txbuf.size = sizeof(*msg);
+		txbuf.fd = fd;
+		memcpy(txbuf.data, msg, sizeof(*msg));
+		return client_queue(c, &txbuf);
+	}
+
+	if (c->in_frame) {
+		/* Batch the replies into one frame.
+		 * Only one file descriptor can be attached per frame. */
+		if (msg->flags & htons(PT_FLG_REPLY))
+			tag = c->rx_tag;
+		size = pt_frame_put(c->txframe.data, c->txframe.size, msg, tag);
+		if (!size || (fd >= 0 && c->txframe.fd >= 0)) {
+			if (client_commit_frame(c)) {
+				if (fd >= 0)
+					close(fd);
+				return -1;
+			}
+			size = pt_frame_put(c->txframe.data, 0, msg, tag);
+		}
+		c->txframe.id = 0xFFFF;
+		c->txframe.size = size;
+		if (fd >= 0)
+			c->txframe.fd = fd;
+		return 0;
+	}
+
+	txbuf.id = coalesce ? msg->id : 0xFFFF;
+	txbuf.size = pt_frame_put(txbuf.data, 0, msg, 0);
+	txbuf.fd = fd;
+
+	return client_queue(c, &txbuf);
+}
+
+static int send_message(struct client *c, struct pt_message *msg, uint16_t flags)
+{
+	msg->flags |= htons(flags);
+
+	return client_queue_message(c, msg, 0, -1);
+}
+
+static int send_message_fd(struct client *c, struct pt_message *msg,
+			   uint16_t flags, int fd)
+{
+	msg->flags |= htons(flags);
+
+	return client_queue_message(c, msg, 0, fd);
+}
+
+static int start_autodim(int enable_on_ac)
 {
 	int err = 0;
 
@@ -94,7 +386,21 @@ static int enable_autodim(int max_percent, int enable_on_ac)
 			return err;
 		}
 	}
+
+	return 0;
+}
+
+static int enable_autodim(int max_percent, int enable_on_ac)
+{
+	int err;
+
+	err = start_autodim(enable_on_ac);
+	if (err)
+		return err;
 	autodim_set_max_percent(backend.autodim, max_percent);
+	backend.backlight->generation++;
+	backend.backlight->autodim_generation++;
+	statepage_update_backlight(backend.backlight);
 
 	return err;
 }
@@ -104,8 +410,121 @@ static void disable_autodim(void)
 	autodim_destroy(backend.autodim);
 	autodim_free(backend.autodim);
 	backend.autodim = NULL;
-	if (backend.backlight)
+	if (backend.backlight) {
 		backend.backlight->autodim_enabled_on_ac = 0;
+		backend.backlight->generation++;
+		backend.backlight->autodim_generation++;
+		statepage_update_backlight(backend.backlight);
+	}
+}
+
+static void set_notifications(struct client *c, int enable,
+			      uint32_t mask, uint32_t predicates)
+{
+	c->notifications_enabled = enable;
+	c->notify_mask = mask ? mask : ~0u;
+	c->notify_predicates = predicates;
+	memset(&c->last_bl, 0, sizeof(c->last_bl));
+	memset(&c->last_bat, 0, sizeof(c->last_bat));
+}
+
+static void send_state(struct client *c, uint16_t id)
+{
+	struct pt_message reply = {
+		.id	= htons(id),
+		.flags	= htons(PT_FLG_REPLY),
+	};
+	int err;
+
+	switch (id) {
+	case PTREQ_BL_GETSTATE:
+		err = backlight_fill_pt_message_stat(backend.backlight, &reply);
+		break;
+	case PTREQ_BAT_GETSTATE:
+		err = battery_fill_pt_message_stat(backend.battery, &reply);
+		break;
+	case PTREQ_BL_AUTODIM_GETSTATE:
+		err = autodim_fill_pt_message_stat(backend.autodim, &reply);
+		break;
+	default:
+		err = -EINVAL;
+	}
+	send_message(c, &reply, err ? 0 : PT_FLG_OK);
+}
+
+/* Set up notifications and features and send a snapshot
+ * of the complete state. There is no event processing in between,
+ * so the snapshot is consistent with the following notifications. */
+static int setup_session(struct client *c, const struct pt_message *msg)
+{
+	uint32_t flags = ntohl(msg->session.flags);
+	int err = 0;
+
+	set_notifications(c, !!(flags & PT_SESSION_FLG_NOTIFY),
+			  ntohl(msg->session.notify_mask),
+			  ntohl(msg->session.notify_predicates));
+	if (flags & PT_SESSION_FLG_XEVREP)
+		err = xevrep_enable(&backend.xevrep);
+
+	send_state(c, PTREQ_BL_GETSTATE);
+	send_state(c, PTREQ_BAT_GETSTATE);
+	send_state(c, PTREQ_BL_AUTODIM_GETSTATE);
+
+	return err;
+}
+
+static void client_reply_brightness(struct client *c, int err)
+{
+	uint16_t tag = c->rx_tag;
+
+	c->rx_tag = c->bl_tag;
+	c->bl_reply.error.code = htonl(err);
+	send_message(c, &c->bl_reply, err ? 0 : PT_FLG_OK);
+	c->rx_tag = tag;
+}
+
+/* Apply the deferred brightness request, if any. */
+static void client_apply_brightness(struct client *c)
+{
+	int err;
+
+	if (!c->bl_pending)
+		return;
+	c->bl_pending = 0;
+	err = backend.backlight->set_brightness(backend.backlight,
+						c->bl_brightness);
+	client_reply_brightness(c, err);
+}
+
+/* Send the states that changed since the generations known
+ * to the client and fill the current generations into the reply. */
+static void send_changed_state(struct client *c, const struct pt_message *msg,
+			       struct pt_message *reply)
+{
+	struct backlight *bl = backend.backlight;
+	struct battery *bat = backend.battery;
+	uint32_t changed = 0;
+
+	if (bl) {
+		reply->generation.bl = htonl(bl->generation);
+		reply->generation.autodim = htonl(bl->autodim_generation);
+		if (msg->generation.bl != reply->generation.bl) {
+			send_state(c, PTREQ_BL_GETSTATE);
+			changed |= PT_GEN_BL;
+		}
+		if (msg->generation.autodim != reply->generation.autodim) {
+			send_state(c, PTREQ_BL_AUTODIM_GETSTATE);
+			changed |= PT_GEN_AUTODIM;
+		}
+	}
+	if (bat) {
+		reply->generation.bat = htonl(bat->generation);
+		if (msg->generation.bat != reply->generation.bat) {
+			send_state(c, PTREQ_BAT_GETSTATE);
+			changed |= PT_GEN_BAT;
+		}
+	}
+	reply->generation.changed = htonl(changed);
 }
 
 static void received_message(struct client *c, struct pt_message *msg)
@@ -114,17 +533,34 @@ static void received_message(struct client *c, struct pt_message *msg)
 		.id	= msg->id,
 		.flags	= (msg->flags & ~htons(PT_FLG_OK)) | htons(PT_FLG_REPLY),
 	};
-	int err;
+	int err, fd;
+
+	c->rx_tokens -= 1000;
+	/* Keep the order of the requests. */
+	if (ntohs(msg->id) != PTREQ_BL_SETBRIGHTNESS)
+		client_apply_brightness(c);
 
 	switch (ntohs(msg->id)) {
 	case PTREQ_PING:
 		send_message(c, &reply, PT_FLG_OK);
 		break;
+	case PTREQ_HELLO:
+		err = -EPROTONOSUPPORT;
+		if (c->version >= 2 && ntohl(msg->hello.version) >= 2) {
+			c->version = min(ntohl(msg->hello.version),
+					 (uint32_t)PT_PROTOCOL_VERSION);
+			c->hello_done = 1;
+			reply.hello.version = htonl(c->version);
+			err = 0;
+		} else {
+			reply.error.code = htonl(err);
+		}
+		send_message(c, &reply, err ? 0 : PT_FLG_OK);
+		break;
 	case PTREQ_WANT_NOTIFY:
-		if (msg->flags & htons(PT_FLG_ENABLE))
-			c->notifications_enabled = 1;
-		else
-			c->notifications_enabled = 0;
+		set_notifications(c, !!(msg->flags & htons(PT_FLG_ENABLE)),
+				  ntohl(msg->notify.mask),
+				  ntohl(msg->notify.predicates));
 		send_message(c, &reply, PT_FLG_OK);
 		break;
 	case PTREQ_XEVREP:
@@ -135,16 +571,50 @@ static void received_message(struct client *c, struct pt_message *msg)
 			xevrep_disable(&backend.xevrep);
 		send_message(c, &reply, err ? 0 : PT_FLG_OK);
 		break;
+	case PTREQ_STATE_PAGE:
+		fd = statepage_get_fd();
+		if (fd < 0) {
+			reply.error.code = htonl(fd);
+			send_message(c, &reply, 0);
+		} else {
+			send_message_fd(c, &reply, PT_FLG_OK, fd);
+		}
+		break;
+	case PTREQ_EVENT_RING:
+		fd = eventring_get_fd();
+		if (fd < 0) {
+			reply.error.code = htonl(fd);
+			send_message(c, &reply, 0);
+		} else {
+			if (!c->ring_reader)
+				eventring_reader_add();
+			c->ring_reader = 1;
+			send_message_fd(c, &reply, PT_FLG_OK, fd);
+		}
+		break;
+	case PTREQ_SESSION:
+		err = setup_session(c, msg);
+		reply.error.code = htonl(err);
+		send_message(c, &reply, err ? 0 : PT_FLG_OK);
+		break;
+	case PTREQ_GET_IF_CHANGED:
+		send_changed_state(c, msg, &reply);
+		send_message(c, &reply, PT_FLG_OK);
+		break;
 	case PTREQ_BL_GETSTATE:
 		err = backlight_fill_pt_message_stat(backend.backlight,
 						     &reply);
 		send_message(c, &reply, err ? 0 : PT_FLG_OK);
 		break;
 	case PTREQ_BL_SETBRIGHTNESS:
-		err = backend.backlight->set_brightness(backend.backlight,
-							msg->bl_set.brightness);
-		reply.error.code = htonl(err);
-		send_message(c, &reply, err ? 0 : PT_FLG_OK);
+		/* Defer the request until the end of the received batch.
+		 * A superseded request is acknowledged without being applied. */
+		if (c->bl_pending)
+			client_reply_brightness(c, 0);
+		c->bl_pending = 1;
+		c->bl_brightness = msg->bl_set.brightness;
+		c->bl_tag = c->rx_tag;
+		c->bl_reply = reply;
 		break;
 	case PTREQ_BL_AUTODIM:
 		err = 0;
@@ -157,6 +627,10 @@ static void received_message(struct client *c, struct pt_message *msg)
 		reply.error.code = htonl(err);
 		send_message(c, &reply, err ? 0 : PT_FLG_OK);
 		break;
+	case PTREQ_BL_AUTODIM_GETSTATE:
+		err = autodim_fill_pt_message_stat(backend.autodim, &reply);
+		send_message(c, &reply, err ? 0 : PT_FLG_OK);
+		break;
 	case PTREQ_BAT_GETSTATE:
 		err = battery_fill_pt_message_stat(backend.battery, &reply);
 		send_message(c, &reply, err ? 0 : PT_FLG_OK);
@@ -166,21 +640,104 @@ static void received_message(struct client *c, struct pt_message *msg)
 	}
 }
 
+static int battery_percent(const struct pt_message *msg)
+{
+	int min = ntohl(msg->bat_stat.min_level);
+	int max = ntohl(msg->bat_stat.max_level);
+	int level = ntohl(msg->bat_stat.level);
+
+	if (max <= min)
+		return level;
+	return (level - min) * 100 / (max - min);
+}
+
+/* Check the subscription mask and the predicates of the client.
+ * Updates the last sent state, if the notification is wanted. */
+static int client_wants_notification(struct client *c,
+				     const struct pt_message *msg)
+{
+	uint32_t pred = c->notify_predicates;
+	uint32_t changed;
+	struct pt_message *last;
+	int first;
+
+	switch (ntohs(msg->id)) {
+	case PTNOTI_BL_CHANGED:
+		if (!(c->notify_mask & PT_NOTIFY_BL))
+			return 0;
+		last = &c->last_bl;
+		first = !last->id;
+		pred &= PT_NOTIFY_PRED_BL_FLAGS | PT_NOTIFY_PRED_BL_BRIGHTNESS;
+		if (pred && !first) {
+			changed = 0;
+			if (last->bl_stat.flags != msg->bl_stat.flags)
+				changed |= PT_NOTIFY_PRED_BL_FLAGS;
+			if (last->bl_stat.brightness != msg->bl_stat.brightness)
+				changed |= PT_NOTIFY_PRED_BL_BRIGHTNESS;
+			if (!(changed & pred))
+				return 0;
+		}
+		break;
+	case PTNOTI_BAT_CHANGED:
+		if (!(c->notify_mask & PT_NOTIFY_BAT))
+			return 0;
+		last = &c->last_bat;
+		first = !last->id;
+		pred &= PT_NOTIFY_PRED_BAT_ONAC | PT_NOTIFY_PRED_BAT_CHARGING |
+			PT_NOTIFY_PRED_BAT_PERCENT;
+		if (pred && !first) {
+			changed = 0;
+			if ((last->bat_stat.flags ^ msg->bat_stat.flags) &
+			    htonl(PT_BAT_FLG_ONAC | PT_BAT_FLG_ACUNKNOWN))
+				changed |= PT_NOTIFY_PRED_BAT_ONAC;
+			if ((last->bat_stat.flags ^ msg->bat_stat.flags) &
+			    htonl(PT_BAT_FLG_CHARGING | PT_BAT_FLG_CHUNKNOWN))
+				changed |= PT_NOTIFY_PRED_BAT_CHARGING;
+			if (battery_percent(last) != battery_percent(msg))
+				changed |= PT_NOTIFY_PRED_BAT_PERCENT;
+			if (!(changed & pred))
+				return 0;
+		}
+		break;
+	default:
+		return 1;
+	}
+	*last = *msg;
+
+	return 1;
+}
+
 static void notify_client(struct client *c, struct pt_message *msg, uint16_t flags)
 {
-	if (c->notifications_enabled)
-		send_message(c, msg, flags);
+	if (c->notifications_enabled && client_wants_notification(c, msg)) {
+		msg->flags |= htons(flags);
+		/* Only the latest state matters to the client. */
+		client_queue_message(c, msg, 1, -1);
+	}
 }
 
 void notify_clients(struct pt_message *msg, uint16_t flags)
 {
 	struct client *c;
 
+	msg->flags |= htons(flags);
+	eventring_publish(msg);
+
 	list_for_each_entry(c, &client_list, list)
 		notify_client(c, msg, flags);
 }
 
-static struct client * new_client(int fd)
+static void client_event(struct iowatch *w, uint32_t events);
+
+static void client_throttle_callback(struct sleeptimer *timer)
+{
+	struct client *c = container_of(timer, struct client, throttle_timer);
+
+	c->throttled = 0;
+	client_update_events(c);
+}
+
+static struct client * new_client(int fd, unsigned int version)
 {
 	struct client *c;
 
@@ -189,6 +746,13 @@ static struct client * new_client(int fd)
 		return NULL;
 
 	c->fd = fd;
+	c->version = version;
+	c->txframe.fd = -1;
+	c->rx_tokens = (long)client_burst * 1000;
+	clock_gettime(CLOCK_MONOTONIC, &c->rx_refill);
+	sleeptimer_init(&c->throttle_timer, "client-throttle",
+			SLEEPTIMER_INTERACTIVE, client_throttle_callback);
+	iowatch_init(&c->watch, "client", client_event);
 	INIT_LIST_HEAD(&c->list);
 
 	return c;
@@ -196,8 +760,14 @@ static struct client * new_client(int fd)
 
 static void remove_client(struct client *c)
 {
+	iowatch_remove(&c->watch);
+	sleeptimer_dequeue(&c->throttle_timer);
+	if (c->ring_reader)
+		eventring_reader_remove();
 	list_del(&c->list);
 	logdebug("Client disconnected, fd=%d\n", c->fd);
+	client_drop_txqueue(c);
+	close(c->fd);
 	free(c);
 }
 
@@ -212,104 +782,267 @@ static void disconnect_client(struct client *c)
 
 static void force_disconnect_clients(void)
 {
+	struct pt_message msg = {
+		.id	= htons(PTNOTI_SRVDOWN),
+		.flags	= htons(PT_FLG_OK),
+	};
 	struct client *c, *c_tmp;
 
+	eventring_publish(&msg);
+
 	list_for_each_entry_safe(c, c_tmp, &client_list, list) {
 		disconnect_client(c);
 		remove_client(c);
 	}
 }
 
-static void recv_clients(void)
+/* Refill the token bucket of the client. Returns 1, if the client
+ * may send another request. Otherwise the client is throttled
+ * until the next token is available. */
+static int client_rx_allowed(struct client *c)
 {
-	struct client *c, *c_tmp;
+	struct timespec now;
+	long elapsed;
+	unsigned int msecs;
+
+	if (!client_rate)
+		return 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - c->rx_refill.tv_sec) * 1000 +
+		  (now.tv_nsec - c->rx_refill.tv_nsec) / 1000000;
+	if (elapsed > 0) {
+		c->rx_tokens = min(c->rx_tokens + elapsed * (long)client_rate,
+				   (long)client_burst * 1000);
+		c->rx_refill = now;
+	}
+	if (c->rx_tokens >= 1000)
+		return 1;
+
+	msecs = (1000 - c->rx_tokens + client_rate - 1) / client_rate;
+	logverbose("Throttling client, fd=%d, for %u msec\n", c->fd, msecs);
+	c->throttled = 1;
+	client_update_events(c);
+	sleeptimer_set_timeout_relative(&c->throttle_timer, msecs);
+	sleeptimer_enqueue(&c->throttle_timer);
+
+	return 0;
+}
+
+/* Receive v1 messages from the byte stream.
+ * Returns -1, if the connection is closed. */
+static int client_recv_stream(struct client *c)
+{
+	unsigned int budget = CLIENT_RX_BUDGET;
 	ssize_t count;
-	size_t pos;
+	int err = 0;
+
+	while (budget && client_rx_allowed(c)) {
+		count = recv(c->fd, (uint8_t *)&c->rxbuf + c->rxpos,
+			     sizeof(c->rxbuf) - c->rxpos, 0);
+		if (count < 0) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == EINTR)
+				continue;
+			err = -1;
+			break;
+		}
+		if (count == 0) {
+			err = -1;
+			break;
+		}
+		c->rxpos += count;
+		if (c->rxpos == sizeof(c->rxbuf)) {
+			c->rxpos = 0;
+			received_message(c, &c->rxbuf);
+			budget--;
+		}
+	}
+	client_apply_brightness(c);
+
+	return err;
+}
+
+/* Reject a request, that exceeds the request rate limit. */
+static void reject_message(struct client *c, struct pt_message *msg)
+{
+	struct pt_message reply = {
+		.id	= msg->id,
+		.flags	= (msg->flags & ~htons(PT_FLG_OK)) | htons(PT_FLG_REPLY),
+		.error	= { .code = htonl(-EAGAIN), },
+	};
+
+	/* Keep the order of the requests. */
+	client_apply_brightness(c);
+	send_message(c, &reply, 0);
+}
+
+static void client_received_frame(struct client *c,
+				  const uint8_t *frame, size_t size)
+{
 	struct pt_message msg;
+	size_t offset = 0;
+	int allowed = 1;
+
+	c->in_frame = 1;
+	while (offset < size) {
+		offset = pt_frame_get(frame, size, offset, &msg, &c->rx_tag);
+		if (!offset) {
+			logerr("Received malformed frame, fd=%d\n", c->fd);
+			break;
+		}
+		if (!c->hello_done && ntohs(msg.id) != PTREQ_HELLO) {
+			logerr("Client did not negotiate the protocol, fd=%d\n",
+			       c->fd);
+			client_fail(c);
+			break;
+		}
+		/* Each record is charged as one request. The records
+		 * beyond the limit are rejected. */
+		if (allowed)
+			allowed = client_rx_allowed(c);
+		if (allowed)
+			received_message(c, &msg);
+		else
+			reject_message(c, &msg);
+	}
+	client_apply_brightness(c);
+	c->in_frame = 0;
+	client_commit_frame(c);
+}
 
-	list_for_each_entry_safe(c, c_tmp, &client_list, list) {
-		pos = 0;
-		do {
-			count = recv(c->fd, &msg, sizeof(msg), 0);
-			if (count < 0)
-				goto next_client;
-			if (count == 0) {
-				remove_client(c);
-				goto next_client;
-			}
-			pos += count;
-		} while (pos != sizeof(msg));
-		received_message(c, &msg);
-next_client:
-		continue;
+/* An empty datagram and the end of the connection both read as 0 bytes. */
+static int client_hung_up(struct client *c)
+{
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN | POLLRDHUP, };
+
+	if (poll(&pfd, 1, 0) <= 0)
+		return 0;
+	return (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR)) &&
+	       !(pfd.revents & POLLIN);
+}
+
+/* Receive v2 frames. Returns -1, if the connection is closed. */
+static int client_recv_frames(struct client *c)
+{
+	uint8_t frame[PT_FRAME_MAX_SIZE];
+	unsigned int budget = CLIENT_RX_BUDGET;
+	ssize_t count;
+
+	while (budget && client_rx_allowed(c)) {
+		count = recv(c->fd, frame, sizeof(frame), MSG_TRUNC);
+		if (count < 0) {
+			if (errno == EAGAIN)
+				break;
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (count == 0 && client_hung_up(c))
+			return -1;
+		budget--;
+		if (count == 0 || (size_t)count > sizeof(frame)) {
+			/* Charge invalid frames as one request. */
+			c->rx_tokens -= 1000;
+			if (count)
+				logerr("Received oversized frame, fd=%d\n", c->fd);
+			continue;
+		}
+		client_received_frame(c, frame, count);
 	}
+
+	return 0;
 }
 
-static void socket_accept(int fd)
+static void client_event(struct iowatch *w, uint32_t events)
 {
-	socklen_t socklen;
-	struct sockaddr_un remoteaddr;
-	int err, cfd;
-	pid_t pid;
-	struct client *c;
+	struct client *c = container_of(w, struct client, watch);
+	int err;
 
-	socklen = sizeof(remoteaddr);
-	cfd = accept(fd, (struct sockaddr *)&remoteaddr, &socklen);
-	if (cfd == -1)
+	if (events & EPOLLOUT)
+		client_flush(c);
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+	if (c->throttled) {
+		/* The client hung up while being throttled. */
+		remove_client(c);
 		return;
-	/* connected */
-	pid = getpid();
-	err = ioctl(cfd, SIOCSPGRP, &pid);
-	if (err) {
-		logerr("Failed to set SIOCSPGRP: %s\n",
-		       strerror(errno));
-		goto error_close;
 	}
-	err = fcntl(cfd, F_SETFL, O_NONBLOCK | O_ASYNC);
+
+	if (c->version >= 2)
+		err = client_recv_frames(c);
+	else
+		err = client_recv_stream(c);
+	if (err)
+		remove_client(c);
+}
+
+static int accept_client(struct listener *l, int cfd)
+{
+	struct client *c;
+	int err;
+
+	c = new_client(cfd, l->version);
+	if (!c)
+		return -ENOMEM;
+	err = iowatch_add(&c->watch, cfd, EPOLLIN);
 	if (err) {
-		logerr("Failed to set flags on client: %s\n",
-		       strerror(errno));
-		goto error_close;
+		free(c);
+		return err;
 	}
-	c = new_client(cfd);
-	if (!c)
-		goto error_close;
 	list_add_tail(&c->list, &client_list);
-	logdebug("Client connected, fd=%d\n", cfd);
+	logdebug("Client connected, fd=%d, protocol v%u\n", cfd, l->version);
 
-	return;
+	return 0;
+}
+
+static void socket_accept(struct iowatch *w, uint32_t events)
+{
+	struct listener *l = container_of(w, struct listener, watch);
+	unsigned int i;
+	int err, cfd;
 
-error_close:
-	close(cfd);
+	/* Accept all pending connections, but not more than
+	 * ACCEPT_BATCH per loop iteration. The listener is level
+	 * triggered, so the remaining ones are accepted in the next
+	 * iteration after the other events have been handled. */
+	for (i = 0; i < ACCEPT_BATCH; i++) {
+		cfd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd == -1) {
+			if (errno != EAGAIN && errno != EINTR &&
+			    errno != ECONNABORTED) {
+				logerr("Failed to accept client: %s\n",
+				       strerror(errno));
+			}
+			break;
+		}
+		err = accept_client(l, cfd);
+		if (err)
+			close(cfd);
+	}
 }
 
-static int new_socket(const char *path, unsigned int perm,
+static int new_socket(const char *path, int type, unsigned int perm,
 		      unsigned int nrlisten)
 {
 	struct sockaddr_un sockaddr;
 	int err, fd;
-	pid_t pid;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
 	if (fd == -1) {
 		logerr("Failed to create socket %s: %s\n",
 		       path, strerror(errno));
 		goto error;
 	}
-	pid = getpid();
-	err = ioctl(fd, SIOCSPGRP, &pid);
-	if (err) {
-		logerr("Failed to set SIOCSPGRP: %s\n",
-		       strerror(errno));
-		goto error_close_sock;
-	}
-	err = fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC);
+	err = fcntl(fd, F_SETFL, O_NONBLOCK);
 	if (err) {
 		logerr("Failed to set flags on socket %s: %s\n",
 		       path, strerror(errno));
 		goto error_close_sock;
 	}
-	if (cmdargs.force)
+	/* On takeover, a stale socket of the previous backend may be left. */
+	if (cmdargs.force || cmdargs.takeover_fd >= 0)
 		unlink(path);
 	sockaddr.sun_family = AF_UNIX;
 	strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
@@ -343,10 +1076,66 @@ error:
 }
 
 
-static int create_socket(void)
+static void remove_listener(struct listener *l)
+{
+	if (l->fd != -1) {
+		iowatch_remove(&l->watch);
+		close(l->fd);
+		l->fd = -1;
+		unlink(l->path);
+	}
+}
+
+/* Create the listener. If fd is not negative, the listening
+ * socket of the previous backend is taken over. */
+static int create_listener(struct listener *l, int fd)
 {
 	int err;
 
+	if (fd >= 0) {
+		l->fd = fd;
+		takeover_fd_inherit(fd, 0);
+	} else {
+		l->fd = new_socket(l->path, l->type, 0666, listen_backlog);
+	}
+	if (l->fd == -1)
+		return -1;
+	iowatch_init(&l->watch, "socket", socket_accept);
+	err = iowatch_add(&l->watch, l->fd, EPOLLIN);
+	if (err) {
+		close(l->fd);
+		l->fd = -1;
+		unlink(l->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void remove_socket(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(listeners); i++)
+		remove_listener(&listeners[i]);
+	rmdir(PT_SOCK_DIR);
+}
+
+static int create_socket(const struct takeover_state *st)
+{
+	unsigned int i;
+	int err, fd, value;
+
+	value = config_get_int(backend.config, "SYSTEM",
+			       "listen_backlog", 128);
+	listen_backlog = clamp(value, 1, 4096);
+	value = config_get_int(backend.config, "SYSTEM",
+			       "client_request_rate", 100);
+	client_rate = clamp(value, 0, 100000);
+	value = config_get_int(backend.config, "SYSTEM",
+			       "client_request_burst", 50);
+	client_burst = clamp(value, 1, 100000);
+
 	err = mkdir(PT_SOCK_DIR, 0755);
 	if (err && errno != EEXIST) {
 		logerr("Failed to create directory %s: %s\n",
@@ -354,25 +1143,186 @@ static int create_socket(void)
 		return err;
 	}
 
-	socket_fd = new_socket(PT_SOCKET, 0666, 10);
-	if (socket_fd == -1)
-		goto err_rmdir;
+	for (i = 0; i < ARRAY_SIZE(listeners); i++) {
+		fd = -1;
+		if (st && i < ARRAY_SIZE(st->listener_fds))
+			fd = st->listener_fds[i];
+		err = create_listener(&listeners[i], fd);
+		if (err)
+			goto error;
+	}
 
 	return 0;
 
-err_rmdir:
-	rmdir(PT_SOCK_DIR);
+error:
+	remove_socket();
 	return -1;
 }
 
-static void remove_socket(void)
+static void save_client(struct client *c, struct takeover_client *tc)
+{
+	struct client_txbuf *buf;
+	unsigned int i;
+
+	tc->fd = c->fd;
+	tc->version = c->version;
+	tc->hello_done = c->hello_done;
+	tc->notifications_enabled = c->notifications_enabled;
+	tc->notify_mask = c->notify_mask;
+	tc->notify_predicates = c->notify_predicates;
+	tc->last_bl = c->last_bl;
+	tc->last_bat = c->last_bat;
+	tc->rxbuf = c->rxbuf;
+	tc->rxpos = c->rxpos;
+	tc->tx_count = min(c->tx_count, (unsigned int)TAKEOVER_TXQUEUE_LEN);
+	tc->txpos = c->txpos;
+	for (i = 0; i < tc->tx_count; i++) {
+		buf = &c->txqueue[(c->tx_head + i) % CLIENT_TXQUEUE_LEN];
+		tc->txqueue[i].id = buf->id;
+		tc->txqueue[i].size = buf->size;
+		tc->txqueue[i].fd = buf->fd;
+		memcpy(tc->txqueue[i].data, buf->data, buf->size);
+	}
+}
+
+static void restore_client(const struct takeover_client *tc)
+{
+	struct client *c;
+	unsigned int i;
+	int err;
+
+	c = new_client(tc->fd, tc->version);
+	if (!c)
+		goto error;
+	c->hello_done = tc->hello_done;
+	c->notifications_enabled = tc->notifications_enabled;
+	c->notify_mask = tc->notify_mask;
+	c->notify_predicates = tc->notify_predicates;
+	c->last_bl = tc->last_bl;
+	c->last_bat = tc->last_bat;
+	c->rxbuf = tc->rxbuf;
+	c->rxpos = min(tc->rxpos, (uint32_t)sizeof(c->rxbuf));
+	c->tx_count = min(tc->tx_count, (uint32_t)CLIENT_TXQUEUE_LEN);
+	c->txpos = tc->txpos;
+	for (i = 0; i < c->tx_count; i++) {
+		c->txqueue[i].id = tc->txqueue[i].id;
+		c->txqueue[i].size = min(tc->txqueue[i].size,
+					 (uint16_t)PT_FRAME_MAX_SIZE);
+		c->txqueue[i].fd = tc->txqueue[i].fd;
+		memcpy(c->txqueue[i].data, tc->txqueue[i].data,
+		       c->txqueue[i].size);
+		takeover_fd_inherit(c->txqueue[i].fd, 0);
+	}
+	takeover_fd_inherit(c->fd, 0);
+	err = iowatch_add(&c->watch, c->fd, EPOLLIN);
+	if (err) {
+		client_drop_txqueue(c);
+		free(c);
+		goto error;
+	}
+	list_add_tail(&c->list, &client_list);
+	logdebug("Client taken over, fd=%d, protocol v%u\n", c->fd, c->version);
+	client_flush(c);
+
+	return;
+
+error:
+	logerr("Failed to take over client, fd=%d\n", tc->fd);
+	close(tc->fd);
+}
+
+static void restore_clients(const struct takeover_state *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->nr_clients; i++)
+		restore_client(&st->clients[i]);
+}
+
+static void takeover_fds_inherit(const struct takeover_state *st, int inherit)
+{
+	const struct takeover_client *tc;
+	unsigned int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(st->listener_fds); i++)
+		takeover_fd_inherit(st->listener_fds[i], inherit);
+	for (i = 0; i < st->nr_clients; i++) {
+		tc = &st->clients[i];
+		takeover_fd_inherit(tc->fd, inherit);
+		for (j = 0; j < tc->tx_count; j++)
+			takeover_fd_inherit(tc->txqueue[j].fd, inherit);
+	}
+}
+
+/* Replace the running backend by a new instance of the executable,
+ * e.g. after a package upgrade. The sockets and the clients are handed
+ * over, so that the clients do not notice. The state page and the
+ * event ring are sealed and are retired instead. Only returns,
+ * if that failed. */
+static void reexec_backend(void)
+{
+	struct takeover_state *st;
+	struct autodim *ad = backend.autodim;
+	struct client *c;
+	unsigned int i, nr_clients = 0;
+
+	list_for_each_entry(c, &client_list, list)
+		nr_clients++;
+	st = takeover_alloc(nr_clients);
+	if (!st) {
+		logerr("Failed to allocate the takeover state\n");
+		return;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(listeners) && i < ARRAY_SIZE(st->listener_fds); i++)
+		st->listener_fds[i] = listeners[i].fd;
+	st->xevrep_pid = backend.xevrep.helper_pid;
+	st->x11lock_pid = backend.x11lock.helper_pid;
+	if (ad) {
+		st->autodim_enabled = 1;
+		st->autodim_enabled_on_ac = backend.backlight->autodim_enabled_on_ac;
+		st->autodim_max_percent = ad->max_percent;
+		st->autodim_step = ad->state;
+	}
+	st->bl_generation = backend.backlight->generation;
+	st->autodim_generation = backend.backlight->autodim_generation;
+	st->bat_generation = backend.battery->generation;
+	i = 0;
+	list_for_each_entry(c, &client_list, list) {
+		client_flush(c);
+		save_client(c, &st->clients[i++]);
+	}
+
+	takeover_fds_inherit(st, 1);
+	statepage_retire(1);
+	eventring_retire(1);
+	takeover_exec(st, saved_argv);
+
+	/* Continue with this instance. */
+	statepage_retire(0);
+	eventring_retire(0);
+	takeover_fds_inherit(st, 0);
+	free(st);
+}
+
+/* Restore the state of the previous backend, that does not
+ * belong to the sockets. */
+static void restore_state(const struct takeover_state *st)
 {
-	if (socket_fd != -1) {
-		close(socket_fd);
-		socket_fd = -1;
-		unlink(PT_SOCKET);
-		rmdir(PT_SOCK_DIR);
+	backend.battery->generation = st->bat_generation;
+	statepage_update_battery(backend.battery);
+	backend.backlight->generation = st->bl_generation;
+	backend.backlight->autodim_generation = st->autodim_generation;
+	if (st->autodim_enabled) {
+		if (start_autodim(st->autodim_enabled_on_ac))
+			logerr("Failed to take over autodimming\n");
+		else
+			autodim_takeover(backend.autodim, st->autodim_max_percent,
+					 st->autodim_step);
 	}
+	statepage_update_backlight(backend.backlight);
+	backend.xevrep.helper_pid = st->xevrep_pid;
+	backend.x11lock.helper_pid = st->x11lock_pid;
 }
 
 static int create_pidfile(void)
@@ -387,7 +1337,7 @@ static int create_pidfile(void)
 	if (!cmdargs.pidfile)
 		return 0;
 
-	fd = open(cmdargs.pidfile, O_RDWR | O_CREAT | O_TRUNC, 0444);
+	fd = open(cmdargs.pidfile, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0444);
 	if (fd < 0) {
 		logerr("Failed to create PID-file %s: %s\n",
 		       cmdargs.pidfile, strerror(errno));
@@ -419,10 +1369,17 @@ static void remove_pidfile(void)
 	}
 }
 
-static void shutdown_cleanup(void)
+static void remove_signalfd(void)
 {
-	block_signals();
+	if (signal_fd != -1) {
+		iowatch_remove(&signal_watch);
+		close(signal_fd);
+		signal_fd = -1;
+	}
+}
 
+static void shutdown_cleanup(void)
+{
 	force_disconnect_clients();
 
 	xevrep_disable(&backend.xevrep);
@@ -444,154 +1401,109 @@ static void shutdown_cleanup(void)
 
 	remove_pidfile();
 	remove_socket();
+	remove_signalfd();
+	eventring_exit();
+	statepage_exit();
+	uevent_monitor_exit();
+	sleeptimer_system_exit();
+	eventloop_exit();
 
 	config_file_free(backend.config);
 	backend.config = NULL;
-
-	unblock_signals();
 }
 
-static inline void enter_signal(void)
+static void handle_signal(struct iowatch *w, uint32_t events)
 {
-	in_signal = 1;
-	compiler_barrier();
-}
-
-static inline void leave_signal(void)
-{
-	compiler_barrier();
-	in_signal = 0;
-}
-
-static void signal_terminate(int signal)
-{
-	enter_signal();
-
-	loginfo("Terminating signal received.\n");
-	shutdown_cleanup();
-
-	leave_signal();
-	exit(1);
-}
-
-static void signal_pipe(int signal)
-{
-	enter_signal();
-
-	logerr("Broken pipe.\n");
-
-	leave_signal();
-}
-
-static void signal_async_io(int signal)
-{
-	enter_signal();
-
-	socket_accept(socket_fd);
-	recv_clients();
-
-	leave_signal();
-}
-
-static void signal_input_event_1(int signal)
-{
-	enter_signal();
-
-	if (backend.autodim)
-		autodim_handle_input_event(backend.autodim);
-
-	leave_signal();
-}
-
-static void signal_input_event_2(int signal)
-{
-	enter_signal();
-
-	backend.devicelock->event(backend.devicelock);
-
-	leave_signal();
-}
-
-static void signal_child(int signal)
-{
-	enter_signal();
-
-	x11lock_sigchld(&backend.x11lock, 0);
-	xevrep_sigchld(&backend.xevrep, 0);
+	struct signalfd_siginfo info;
+	ssize_t count;
 
-	leave_signal();
+	while (1) {
+		count = read(w->fd, &info, sizeof(info));
+		if (count != sizeof(info))
+			break;
+
+		switch (info.ssi_signo) {
+		case SIGINT:
+		case SIGTERM:
+			loginfo("Terminating signal received.\n");
+			terminate = 1;
+			break;
+		case SIGHUP:
+			loginfo("Re-exec signal received.\n");
+			reexec = 1;
+			break;
+		case SIGUSR1:
+			/* X11 input event reported by the xevrep helper. */
+			if (backend.autodim)
+				autodim_handle_input_event(backend.autodim);
+			break;
+		case SIGCHLD:
+			x11lock_sigchld(&backend.x11lock, 0);
+			xevrep_sigchld(&backend.xevrep, 0);
+			break;
+		default:
+			logerr("Received unexpected signal %u\n",
+			       info.ssi_signo);
+		}
+	}
 }
 
-#define sigset_set_blocked_sigs(setp) do {	\
+#define sigset_set_handled_sigs(setp) do {	\
 		sigemptyset((setp));		\
 		sigaddset((setp), SIGCHLD);	\
 		sigaddset((setp), SIGUSR1);	\
-		sigaddset((setp), SIGUSR2);	\
-		sigaddset((setp), SIGIO);	\
-		sigaddset((setp), SIGPIPE);	\
 		sigaddset((setp), SIGINT);	\
 		sigaddset((setp), SIGTERM);	\
+		sigaddset((setp), SIGHUP);	\
 	} while (0)
 
-void block_signals(void)
+/* Block all handled signals. They are queued until
+ * they are picked up from the signalfd by the mainloop. */
+static int block_handled_signals(void)
 {
+	struct sigaction act;
 	sigset_t set;
 
-	if (!in_signal) {
-		assert(sig_block_count >= 0);
-		if (sig_block_count++ == 0) {
-			sigset_set_blocked_sigs(&set);
-			if (sigprocmask(SIG_BLOCK, &set, NULL)) {
-				logerr("Failed to block signals: %s\n",
-				       strerror(errno));
-			}
-		}
+	memset(&act, 0, sizeof(act));
+	sigemptyset(&act.sa_mask);
+	act.sa_handler = SIG_IGN;
+	if (sigaction(SIGPIPE, &act, NULL)) {
+		logerr("Failed to ignore SIGPIPE: %s\n",
+		       strerror(errno));
+		return -errno;
 	}
-	compiler_barrier();
-}
 
-void unblock_signals(void)
-{
-	sigset_t set;
-
-	compiler_barrier();
-	if (!in_signal) {
-		if (--sig_block_count == 0) {
-			sigset_set_blocked_sigs(&set);
-			if (sigprocmask(SIG_UNBLOCK, &set, NULL)) {
-				logerr("Failed to unblock signals: %s\n",
-				       strerror(errno));
-			}
-		}
-		assert(sig_block_count >= 0);
+	sigset_set_handled_sigs(&set);
+	if (sigprocmask(SIG_BLOCK, &set, NULL)) {
+		logerr("Failed to block signals: %s\n",
+		       strerror(errno));
+		return -errno;
 	}
-}
-
-static int install_sighandler(int signal, int ignore, void (*handler)(int))
-{
-	struct sigaction act;
-
-	memset(&act, 0, sizeof(act));
-	sigset_set_blocked_sigs(&act.sa_mask);
-	act.sa_flags = 0;
-	act.sa_handler = ignore ? SIG_IGN : handler;
 
-	return sigaction(signal, &act, NULL);
+	return 0;
 }
 
-static int setup_signal_handlers(int ignore_signals)
+static int create_signalfd(void)
 {
-	int err = 0;
+	sigset_t set;
+	int err;
 
-	err |= install_sighandler(SIGINT, ignore_signals, signal_terminate);
-	err |= install_sighandler(SIGTERM, ignore_signals, signal_terminate);
-	err |= install_sighandler(SIGPIPE, ignore_signals, signal_pipe);
-	err |= install_sighandler(SIGIO, ignore_signals, signal_async_io);
-	err |= install_sighandler(SIGUSR1, ignore_signals, signal_input_event_1);
-	err |= install_sighandler(SIGUSR2, ignore_signals, signal_input_event_2);
-	err |= install_sighandler(SIGCHLD, ignore_signals, signal_child);
+	sigset_set_handled_sigs(&set);
+	signal_fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		logerr("Failed to create signalfd: %s\n",
+		       strerror(errno));
+		return -errno;
+	}
+	iowatch_init(&signal_watch, "signals", handle_signal);
+	err = iowatch_add(&signal_watch, signal_fd, EPOLLIN);
+	if (err) {
+		close(signal_fd);
+		signal_fd = -1;
+		return err;
+	}
 
-	return err ? -1 : 0;
+	return 0;
 }
 
 static int set_niceness(void)
@@ -613,29 +1525,59 @@ static int set_niceness(void)
 static int mainloop(void)
 {
 	int err, value, on_ac;
-	unsigned int timer_errors = 0;
+	unsigned int loop_errors = 0;
+	struct takeover_state *st = NULL;
 
 	log_initialize();
 
-	err = setup_signal_handlers(1);
+	err = block_handled_signals();
 	if (err)
 		goto error;
+	takeover_init();
+	if (cmdargs.takeover_fd >= 0) {
+		st = takeover_load(cmdargs.takeover_fd);
+		if (st) {
+			loginfo("Taking over from the previous backend\n");
+			backend.takeover = 1;
+		} else {
+			/* Start from scratch. Drop everything the previous
+			 * backend handed over, including the client sockets,
+			 * so that the clients see the connection close. */
+			log_exit();
+			takeover_close_inherited();
+			log_initialize();
+		}
+	}
 
 	err = -ENOMEM;
 	backend.config = config_file_parse("/etc/pwrtray-backendrc");
 	if (!backend.config)
 		goto error;
+	err = eventloop_init();
+	if (err)
+		goto error;
 	err = sleeptimer_system_init();
+	if (err)
+		goto error;
+	uevent_monitor_init();
+	err = statepage_init();
+	if (err)
+		goto error;
+	err = eventring_init();
 	if (err)
 		goto error;
 	err = -ENOMEM;
 	backend.battery = battery_probe();
 	if (!backend.battery)
 		goto error;
+	statepage_update_battery(backend.battery);
 	backend.backlight = backlight_probe();
 	if (!backend.backlight)
 		goto error;
-	if (config_get_bool(backend.config, "BACKLIGHT", "autodim_default_on", 0)) {
+	statepage_update_backlight(backend.backlight);
+	if (st) {
+		restore_state(st);
+	} else if (config_get_bool(backend.config, "BACKLIGHT", "autodim_default_on", 0)) {
 		value = backlight_get_percentage(backend.backlight);
 		if (value < 0)
 			value = 100;
@@ -647,34 +1589,46 @@ static int mainloop(void)
 	backend.devicelock = devicelock_probe();
 	if (!backend.devicelock)
 		goto error;
-	err = create_socket();
+	err = create_socket(st);
 	if (err)
 		goto error;
+	if (st)
+		restore_clients(st);
 	err = create_pidfile();
 	if (err)
 		goto error;
-	err = setup_signal_handlers(0);
+	err = create_signalfd();
 	if (err)
 		goto error;
 	err = set_niceness();
 	if (err)
 		goto error;
 
+	free(st);
+	st = NULL;
+	backend.takeover = 0;
+
 	loginfo("pwrtray-backend started\n");
 
-	while (1) {
-		err = sleeptimer_wait_next();
-		if (!err)
+	while (!terminate) {
+		err = eventloop_wait(-1);
+		if (reexec) {
+			reexec = 0;
+			reexec_backend();
+		}
+		if (err >= 0)
 			continue;
-		if (timer_errors < 10) {
-			timer_errors++;
-			logdebug("Mainloop: sleeptimer_wait_next() failed with %d (%s)\n",
+		if (loop_errors < 10) {
+			loop_errors++;
+			logdebug("Mainloop: eventloop_wait() failed with %d (%s)\n",
 				 err, strerror(-err));
 		}
 		msleep(1000);
 	}
+	err = 0;
 
 error:
+	free(st);
 	shutdown_cleanup();
 	log_exit();
 
@@ -688,8 +1642,10 @@ int main(int argc, char **argv)
 	err = parse_commandline(argc, argv);
 	if (err)
 		return (err < 0) ? 1 : 0;
+	saved_argv = argv;
 
-	if (cmdargs.background) {
+	/* On takeover we already are in the background. */
+	if (cmdargs.background && cmdargs.takeover_fd < 0) {
 		err = daemon(0, 0);
 		if (err) {
 			logerr("Failed to fork into background: %s\n",
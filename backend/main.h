@@ -19,13 +19,11 @@ struct backend {
 	struct x11lock x11lock;
 	struct xevrep xevrep;
 	struct autodim *autodim;
+	int takeover;		/* Taking over from a previous backend */
 };
 
 extern struct backend backend;
 
-void block_signals(void);
-void unblock_signals(void);
-
 void notify_clients(struct pt_message *msg, uint16_t flags);
 
 #endif /* BACKEND_MAIN_H_ */
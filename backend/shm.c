@@ -0,0 +1,120 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "shm.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+
+int shm_area_create(struct shm_area *area, const char *name, size_t size)
+{
+	int err;
+
+	memset(area, 0, sizeof(*area));
+	area->name = name;
+	area->size = round_up(size, (size_t)sysconf(_SC_PAGESIZE));
+
+	area->fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (area->fd < 0) {
+		logerr("shm: Failed to create memfd %s: %s\n",
+		       name, strerror(errno));
+		err = -errno;
+		goto error;
+	}
+	if (ftruncate(area->fd, area->size)) {
+		logerr("shm: Failed to resize memfd %s: %s\n",
+		       name, strerror(errno));
+		err = -errno;
+		goto err_close;
+	}
+	area->mem = mmap(NULL, area->size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED, area->fd, 0);
+	if (area->mem == MAP_FAILED) {
+		logerr("shm: Failed to map memfd %s: %s\n",
+		       name, strerror(errno));
+		area->mem = NULL;
+		err = -errno;
+		goto err_close;
+	}
+	if (fcntl(area->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW)) {
+		logdebug("shm: Failed to seal memfd %s: %s\n",
+			 name, strerror(errno));
+	}
+
+	return 0;
+
+err_close:
+	close(area->fd);
+error:
+	area->fd = -1;
+	return err;
+}
+
+/* Seal the area against writing through any new mapping or file
+ * descriptor. Only the existing writable mapping of the backend stays.
+ * So clients can not get write access, even if they reopen the fd
+ * through /proc. */
+int shm_area_seal(struct shm_area *area)
+{
+	if (fcntl(area->fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL)) {
+		logerr("shm: Failed to write-seal memfd %s: %s\n",
+		       area->name, strerror(errno));
+		return -errno;
+	}
+	area->sealed = 1;
+
+	return 0;
+}
+
+void shm_area_destroy(struct shm_area *area)
+{
+	if (area->mem) {
+		munmap(area->mem, area->size);
+		area->mem = NULL;
+	}
+	if (area->fd >= 0) {
+		close(area->fd);
+		area->fd = -1;
+	}
+}
+
+/* Get a new read-only file descriptor for the area.
+ * The caller must close it. */
+int shm_area_get_readonly_fd(struct shm_area *area)
+{
+	char path[64];
+	int fd;
+
+	if (!area->mem)
+		return -ENODEV;
+
+	/* Reopen the memfd read-only, so that the clients
+	 * can neither write to nor resize the area. */
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", area->fd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		logerr("shm: Failed to reopen memfd %s: %s\n",
+		       area->name, strerror(errno));
+		return -errno;
+	}
+
+	return fd;
+}
@@ -0,0 +1,22 @@
+#ifndef BACKEND_SHM_H_
+#define BACKEND_SHM_H_
+
+#include <stddef.h>
+
+
+/* A shared memory area, that is writable by the backend
+ * and handed out read-only to the clients. */
+struct shm_area {
+	const char *name;
+	int fd;
+	void *mem;
+	size_t size;
+	int sealed;	/* No new writable mappings possible */
+};
+
+int shm_area_create(struct shm_area *area, const char *name, size_t size);
+int shm_area_seal(struct shm_area *area);
+void shm_area_destroy(struct shm_area *area);
+int shm_area_get_readonly_fd(struct shm_area *area);
+
+#endif /* BACKEND_SHM_H_ */
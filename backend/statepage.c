@@ -0,0 +1,117 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "statepage.h"
+#include "backlight.h"
+#include "battery.h"
+#include "shm.h"
+
+#include <errno.h>
+
+
+static struct shm_area state_area = { .fd = -1, };
+static struct pt_state_page *state_page;
+
+
+static void statepage_write_begin(void)
+{
+	__atomic_store_n(&state_page->seq, state_page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void statepage_write_end(void)
+{
+	__atomic_store_n(&state_page->seq, state_page->seq + 1, __ATOMIC_RELEASE);
+}
+
+void statepage_update_backlight(struct backlight *b)
+{
+	struct pt_message msg = {
+		.id	= htons(PTNOTI_BL_CHANGED),
+		.flags	= htons(PT_FLG_OK),
+	};
+
+	if (!state_page)
+		return;
+	if (b && backlight_fill_pt_message_stat(b, &msg))
+		return;
+
+	statepage_write_begin();
+	state_page->bl = msg;
+	state_page->bl_generation = b ? b->generation : 0;
+	statepage_write_end();
+}
+
+void statepage_update_battery(struct battery *b)
+{
+	struct pt_message msg = {
+		.id	= htons(PTNOTI_BAT_CHANGED),
+		.flags	= htons(PT_FLG_OK),
+	};
+
+	if (!state_page)
+		return;
+	if (b && battery_fill_pt_message_stat(b, &msg))
+		return;
+
+	statepage_write_begin();
+	state_page->bat = msg;
+	state_page->bat_generation = b ? b->generation : 0;
+	statepage_write_end();
+}
+
+/* Retire the state page before a takeover. The page is sealed and can
+ * not be written by the next instance. So the clients have to request
+ * a new one. Called with retire=0, if the takeover failed. */
+void statepage_retire(int retire)
+{
+	if (!state_page)
+		return;
+
+	statepage_write_begin();
+	state_page->magic = retire ? 0 : PT_STATE_MAGIC;
+	statepage_write_end();
+}
+
+/* Get a new read-only file descriptor for the state page.
+ * The caller must close it. */
+int statepage_get_fd(void)
+{
+	/* Never hand out a page, that clients could write to. */
+	if (!state_area.sealed)
+		return -EPERM;
+
+	return shm_area_get_readonly_fd(&state_area);
+}
+
+int statepage_init(void)
+{
+	int err;
+
+	err = shm_area_create(&state_area, "pwrtray-state",
+			      sizeof(*state_page));
+	if (err)
+		return err;
+	state_page = state_area.mem;
+	state_page->magic = PT_STATE_MAGIC;
+	shm_area_seal(&state_area);
+
+	return 0;
+}
+
+void statepage_exit(void)
+{
+	state_page = NULL;
+	shm_area_destroy(&state_area);
+}
@@ -0,0 +1,19 @@
+#ifndef BACKEND_STATEPAGE_H_
+#define BACKEND_STATEPAGE_H_
+
+#include "api.h"
+
+
+struct backlight;
+struct battery;
+
+int statepage_init(void);
+void statepage_exit(void);
+
+int statepage_get_fd(void);
+void statepage_retire(int retire);
+
+void statepage_update_backlight(struct backlight *b);
+void statepage_update_battery(struct battery *b);
+
+#endif /* BACKEND_STATEPAGE_H_ */
@@ -0,0 +1,229 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "takeover.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+static char exe_path[PATH_MAX];
+
+
+/* Resolve the executable path now. On a package upgrade the file
+ * is replaced and /proc/self/exe points to the deleted old binary. */
+int takeover_init(void)
+{
+	ssize_t len;
+
+	len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+	if (len < 0) {
+		logerr("takeover: Failed to resolve the executable: %s\n",
+		       strerror(errno));
+		exe_path[0] = '\0';
+		return -errno;
+	}
+	exe_path[len] = '\0';
+
+	return 0;
+}
+
+struct takeover_state * takeover_alloc(unsigned int nr_clients)
+{
+	struct takeover_state *st;
+	unsigned int i;
+
+	st = zalloc(takeover_state_size(nr_clients));
+	if (!st)
+		return NULL;
+	st->magic = TAKEOVER_MAGIC;
+	st->version = TAKEOVER_VERSION;
+	st->size = takeover_state_size(nr_clients);
+	for (i = 0; i < ARRAY_SIZE(st->listener_fds); i++)
+		st->listener_fds[i] = -1;
+	st->nr_clients = nr_clients;
+
+	return st;
+}
+
+/* Set whether the file descriptor is inherited by the new backend. */
+int takeover_fd_inherit(int fd, int inherit)
+{
+	int flags;
+
+	if (fd < 0)
+		return 0;
+	flags = fcntl(fd, F_GETFD);
+	if (flags < 0)
+		return -errno;
+	if (inherit)
+		flags &= ~FD_CLOEXEC;
+	else
+		flags |= FD_CLOEXEC;
+	if (fcntl(fd, F_SETFD, flags))
+		return -errno;
+
+	return 0;
+}
+
+/* Close all file descriptors above stdio. Used, if the state of
+ * the previous backend could not be loaded. The sockets and other
+ * descriptors it handed over are unknown then and would leak. */
+void takeover_close_inherited(void)
+{
+	long fd, max_fd;
+
+	if (!close_range(3, ~0U, 0))
+		return;
+	max_fd = sysconf(_SC_OPEN_MAX);
+	if (max_fd < 0)
+		max_fd = 1024;
+	for (fd = 3; fd < max_fd; fd++)
+		close(fd);
+}
+
+static int takeover_write_state(const struct takeover_state *st)
+{
+	const uint8_t *buf = (const uint8_t *)st;
+	size_t pos = 0;
+	ssize_t res;
+	int fd;
+
+	/* Not close-on-exec. The new backend reads and closes it. */
+	fd = memfd_create("pwrtray-takeover", 0);
+	if (fd < 0)
+		return -errno;
+	while (pos < st->size) {
+		res = write(fd, buf + pos, st->size - pos);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			close(fd);
+			return -errno;
+		}
+		pos += res;
+	}
+
+	return fd;
+}
+
+/* Execute the new backend and hand the state over to it.
+ * Only returns on failure. The file descriptors referenced
+ * by the state must be made inheritable by the caller. */
+int takeover_exec(struct takeover_state *st, char **argv)
+{
+	char fdstr[16];
+	char **new_argv;
+	unsigned int argc, i, j;
+	int err, fd;
+
+	if (!exe_path[0])
+		return -ENOENT;
+
+	for (argc = 0; argv[argc]; argc++)
+		;
+	new_argv = calloc(argc + 3, sizeof(*new_argv));
+	if (!new_argv)
+		return -ENOMEM;
+	fd = takeover_write_state(st);
+	if (fd < 0) {
+		err = fd;
+		logerr("takeover: Failed to write the state: %s\n",
+		       strerror(-err));
+		goto out_free;
+	}
+
+	/* Replace the --takeover argument of a previous takeover. */
+	for (i = 0, j = 0; i < argc; i++) {
+		if (strcmp(argv[i], "--takeover") == 0) {
+			i++;
+			continue;
+		}
+		if (strncmp(argv[i], "--takeover=", 11) == 0)
+			continue;
+		new_argv[j++] = argv[i];
+	}
+	snprintf(fdstr, sizeof(fdstr), "%d", fd);
+	new_argv[j++] = "--takeover";
+	new_argv[j++] = fdstr;
+	new_argv[j] = NULL;
+
+	loginfo("Executing %s\n", exe_path);
+	fflush(NULL);
+	execv(exe_path, new_argv);
+	err = -errno;
+	logerr("takeover: Failed to execute %s: %s\n",
+	       exe_path, strerror(errno));
+
+	close(fd);
+out_free:
+	free(new_argv);
+
+	return err;
+}
+
+/* Read the state handed over by the previous backend.
+ * The caller must free the returned state. */
+struct takeover_state * takeover_load(int fd)
+{
+	struct takeover_state *st = NULL;
+	struct stat stat;
+	size_t pos = 0;
+	ssize_t res;
+
+	if (fstat(fd, &stat) ||
+	    (size_t)stat.st_size < sizeof(*st) ||
+	    (size_t)stat.st_size > takeover_state_size(65536)) {
+		logerr("takeover: Invalid state fd %d\n", fd);
+		goto out_close;
+	}
+	st = malloc(stat.st_size);
+	if (!st)
+		goto out_close;
+	while (pos < (size_t)stat.st_size) {
+		res = pread(fd, (uint8_t *)st + pos, stat.st_size - pos, pos);
+		if (res <= 0) {
+			if (res < 0 && errno == EINTR)
+				continue;
+			logerr("takeover: Failed to read the state\n");
+			goto err_free;
+		}
+		pos += res;
+	}
+	if (st->magic != TAKEOVER_MAGIC || st->version != TAKEOVER_VERSION ||
+	    st->size != (size_t)stat.st_size ||
+	    st->size != takeover_state_size(st->nr_clients)) {
+		logerr("takeover: Incompatible state (version %u)\n",
+		       st->version);
+		goto err_free;
+	}
+
+out_close:
+	close(fd);
+	return st;
+
+err_free:
+	free(st);
+	st = NULL;
+	goto out_close;
+}
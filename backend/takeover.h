@@ -0,0 +1,76 @@
+#ifndef BACKEND_TAKEOVER_H_
+#define BACKEND_TAKEOVER_H_
+
+#include "api.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+#define TAKEOVER_MAGIC		0x50545458
+#define TAKEOVER_VERSION	3
+
+#define TAKEOVER_MAX_LISTENERS	4
+#define TAKEOVER_TXQUEUE_LEN	32
+
+/* An unsent message or frame of a client. */
+struct takeover_txbuf {
+	uint16_t id;
+	uint16_t size;
+	int32_t fd;		/* Inherited file descriptor to pass, or -1 */
+	uint8_t data[PT_FRAME_MAX_SIZE];
+};
+
+struct takeover_client {
+	int32_t fd;		/* Inherited socket */
+	uint32_t version;
+	int32_t hello_done;
+	int32_t notifications_enabled;
+	uint32_t notify_mask;
+	uint32_t notify_predicates;
+	struct pt_message last_bl;
+	struct pt_message last_bat;
+	/* Partially received v1 message */
+	struct pt_message rxbuf;
+	uint32_t rxpos;
+	/* Unsent messages. The head message is partially sent. */
+	uint32_t tx_count;
+	uint32_t txpos;
+	struct takeover_txbuf txqueue[TAKEOVER_TXQUEUE_LEN];
+};
+
+/* The state that is handed from the running backend
+ * to the newly executed one. */
+struct takeover_state {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	int32_t listener_fds[TAKEOVER_MAX_LISTENERS];
+	int32_t xevrep_pid;
+	int32_t x11lock_pid;
+	int32_t autodim_enabled;
+	int32_t autodim_enabled_on_ac;
+	uint32_t autodim_max_percent;
+	uint32_t autodim_step;
+	uint32_t bl_generation;
+	uint32_t autodim_generation;
+	uint32_t bat_generation;
+	uint32_t nr_clients;
+	struct takeover_client clients[];
+};
+
+static inline size_t takeover_state_size(unsigned int nr_clients)
+{
+	return sizeof(struct takeover_state) +
+	       nr_clients * sizeof(struct takeover_client);
+}
+
+int takeover_init(void);
+
+struct takeover_state * takeover_alloc(unsigned int nr_clients);
+int takeover_fd_inherit(int fd, int inherit);
+int takeover_exec(struct takeover_state *st, char **argv);
+struct takeover_state * takeover_load(int fd);
+void takeover_close_inherited(void);
+
+#endif /* BACKEND_TAKEOVER_H_ */
@@ -16,6 +16,8 @@
 #include "main.h"
 #include "log.h"
 #include "conf.h"
+#include "util.h"
+#include "eventloop.h"
 
 #include <time.h>
 #include <unistd.h>
@@ -24,22 +26,31 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
-#include <sys/prctl.h>
+#include <sys/timerfd.h>
 
 
-static LIST_HEAD(timer_list);
-static timer_id_t id_counter;
+/* Binary min-heap of the queued timers, ordered by deadline. */
+static struct sleeptimer **timer_heap;
+static unsigned int timer_heap_size;
+static unsigned int timer_heap_allocated;
+/* Expired timers that are about to run. */
+static LIST_HEAD(expired_list);
 
+static int timer_fd = -1;
+static struct iowatch timer_watch;
+static struct timespec timer_armed;
 
-static inline void timer_lock(void)
-{
-	block_signals();
-}
+/* Slack per latency class, in milliseconds. */
+static unsigned int timer_slack[NR_SLEEPTIMER_LATENCIES];
+/* Phase grid for periodic timers, in milliseconds. */
+static unsigned int timer_grid;
+
+static struct {
+	struct timespec period_start;
+	unsigned int wakeups;
+	unsigned int expirations;
+} timer_stats;
 
-static inline void timer_unlock(void)
-{
-	unblock_signals();
-}
 
 static void timespec_add_msec(struct timespec *ts, unsigned int msec)
 {
@@ -57,27 +68,16 @@ static void timespec_add_msec(struct timespec *ts, unsigned int msec)
 	ts->tv_sec += seconds;
 }
 
-static int timespec_bigger(const struct timespec *a, const struct timespec *b)
-{
-	if (a->tv_sec > b->tv_sec)
-		return 1;
-	if ((a->tv_sec == b->tv_sec) && (a->tv_nsec > b->tv_nsec))
-		return 1;
-	return 0;
-}
-
-static inline int timespec_after(const struct timespec *a, const struct timespec *b)
-{
-	return timespec_bigger(a, b);
-}
-
 void sleeptimer_init(struct sleeptimer *timer,
 		     const char *name,
+		     enum sleeptimer_latency latency,
 		     sleeptimer_callback_t callback)
 {
 	memset(timer, 0, sizeof(*timer));
 	timer->name = name;
+	timer->latency = latency;
 	timer->callback = callback;
+	timer->heap_index = -1;
 	INIT_LIST_HEAD(&timer->list);
 	logverbose("timer: %s registered\n", name);
 }
@@ -96,97 +96,304 @@ void sleeptimer_set_timeout_relative(struct sleeptimer *timer,
 	timespec_add_msec(&timer->timeout, msecs);
 }
 
-static void do_sleeptimer_dequeue(struct sleeptimer *timer)
+static inline void heap_set(unsigned int index, struct sleeptimer *timer)
 {
-	list_del_init(&timer->list);
+	timer_heap[index] = timer;
+	timer->heap_index = (int)index;
 }
 
-void sleeptimer_enqueue(struct sleeptimer *timer)
+static void heap_sift_up(unsigned int index)
 {
-	struct sleeptimer *i;
-	int inserted = 0;
+	struct sleeptimer *timer = timer_heap[index];
+	unsigned int parent;
 
-	timer_lock();
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (!timespec_after(&timer_heap[parent]->deadline, &timer->deadline))
+			break;
+		heap_set(index, timer_heap[parent]);
+		index = parent;
+	}
+	heap_set(index, timer);
+}
 
-	if (!list_empty(&timer->list))
-		do_sleeptimer_dequeue(timer);
+static void heap_sift_down(unsigned int index)
+{
+	struct sleeptimer *timer = timer_heap[index];
+	unsigned int child;
 
-	list_for_each_entry(i, &timer_list, list) {
-		if (timespec_after(&i->timeout, &timer->timeout)) {
-			list_add_tail(&timer->list, &i->list);
-			inserted = 1;
+	while (1) {
+		child = index * 2 + 1;
+		if (child >= timer_heap_size)
 			break;
-		}
+		if (child + 1 < timer_heap_size &&
+		    timespec_after(&timer_heap[child]->deadline,
+				   &timer_heap[child + 1]->deadline))
+			child++;
+		if (!timespec_after(&timer->deadline, &timer_heap[child]->deadline))
+			break;
+		heap_set(index, timer_heap[child]);
+		index = child;
 	}
-	if (!inserted)
-		list_add_tail(&timer->list, &timer_list);
-	timer->id = id_counter++;
-
-	timer_unlock();
+	heap_set(index, timer);
 }
 
-void sleeptimer_dequeue(struct sleeptimer *timer)
+static int heap_insert(struct sleeptimer *timer)
 {
-	timer_lock();
-	do_sleeptimer_dequeue(timer);
-	timer_unlock();
+	unsigned int newcount;
+	void *buf;
+
+	if (timer_heap_size >= timer_heap_allocated) {
+		newcount = max(timer_heap_allocated * 2, 8u);
+		buf = realloc(timer_heap, newcount * sizeof(*timer_heap));
+		if (!buf)
+			return -ENOMEM;
+		timer_heap = buf;
+		timer_heap_allocated = newcount;
+	}
+	heap_set(timer_heap_size++, timer);
+	heap_sift_up(timer_heap_size - 1);
+
+	return 0;
 }
 
-int sleeptimer_system_init(void)
+static void heap_remove(struct sleeptimer *timer)
 {
-#ifdef PR_SET_TIMERSLACK
-	unsigned long slack;
+	unsigned int index = (unsigned int)timer->heap_index;
+	struct sleeptimer *last;
 
-	slack = config_get_int(backend.config, "SYSTEM", "event_slack", 1010);
-	slack *= 1000000ul; /* To nanoseconds */
-	if (prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0))
-		logerr("Failed to set timerslack to %lu ns. Ignoring.\n", slack);
-#else
-# warning "PR_SET_TIMERSLACK not available. Ignoring."
-#endif
-	return 0;
+	timer->heap_index = -1;
+	last = timer_heap[--timer_heap_size];
+	if (last == timer)
+		return;
+	heap_set(index, last);
+	if (index > 0 &&
+	    timespec_after(&timer_heap[(index - 1) / 2]->deadline, &last->deadline))
+		heap_sift_up(index);
+	else
+		heap_sift_down(index);
 }
 
-int sleeptimer_wait_next(void)
+/* Set the timeout to roughly msecs from now, but snap it to the
+ * global phase grid. That way independent periodic timers expire at
+ * the same time and share a wakeup. */
+void sleeptimer_set_timeout_aligned(struct sleeptimer *timer,
+				    unsigned int msecs)
 {
-	struct timespec timeout;
-	struct sleeptimer *timer = NULL;
-	timer_id_t timer_id = 0;
+	struct timespec now;
+	uint64_t grid, expire;
 	int err;
 
-	timer_lock();
-	if (!list_empty(&timer_list)) {
-		timer = list_first_entry(&timer_list, struct sleeptimer, list);
-		timeout = timer->timeout;
-		timer_id = timer->id;
+	err = clock_gettime(CLOCK_MONOTONIC, &now);
+	if (err) {
+		logerr("WARNING: clock_gettime() failed: %s\n",
+		       strerror(errno));
+		return;
+	}
+
+	expire = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	expire += msecs;
+	grid = min(timer_grid, msecs);
+	if (grid) {
+		/* Round down. This is still in the future,
+		 * because msecs is not smaller than the grid. */
+		expire = (expire / grid) * grid;
 	}
-	timer_unlock();
-	if (!timer)
-		return -ENOENT;
+	timer->timeout.tv_sec = expire / 1000;
+	timer->timeout.tv_nsec = (expire % 1000) * 1000000;
+}
 
-	while (1) {
-		err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-				      &timeout, NULL);
-		if (!err)
-			break;
-		if (err == EAGAIN)
+/* Program the timerfd to the earliest deadline in the queue. */
+static void sleeptimer_rearm(void)
+{
+	struct itimerspec its;
+
+	if (timer_fd < 0)
+		return;
+	memset(&its, 0, sizeof(its));
+	if (timer_heap_size) {
+		its.it_value = timer_heap[0]->deadline;
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+			its.it_value.tv_nsec = 1; /* Zero would disarm */
+	}
+	if (its.it_value.tv_sec == timer_armed.tv_sec &&
+	    its.it_value.tv_nsec == timer_armed.tv_nsec)
+		return;
+
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL)) {
+		logerr("WARNING: timerfd_settime() failed: %s\n",
+		       strerror(errno));
+		return;
+	}
+	timer_armed = its.it_value;
+}
+
+static void do_sleeptimer_dequeue(struct sleeptimer *timer)
+{
+	if (timer->heap_index >= 0)
+		heap_remove(timer);
+	list_del_init(&timer->list);
+}
+
+void sleeptimer_enqueue(struct sleeptimer *timer)
+{
+	do_sleeptimer_dequeue(timer);
+	timer->deadline = timer->timeout;
+	timespec_add_msec(&timer->deadline, timer_slack[timer->latency]);
+	if (heap_insert(timer)) {
+		logerr("timer: Failed to enqueue %s: Out of memory\n",
+		       timer->name);
+		return;
+	}
+	sleeptimer_rearm();
+}
+
+void sleeptimer_dequeue(struct sleeptimer *timer)
+{
+	do_sleeptimer_dequeue(timer);
+	sleeptimer_rearm();
+}
+
+/* Run all timers that are due. That are all timers whose timeout has
+ * passed, so whose slack window has already opened, even if their
+ * deadline is later. That way the tolerant timers share the wakeup.
+ * The heap is ordered by deadline, so it is scanned completely. It is small.
+ * The timers are moved to the expired list first, so that callbacks
+ * can safely re-enqueue themselves or dequeue other timers. */
+static unsigned int sleeptimer_run_expired(void)
+{
+	struct sleeptimer *timer, *pos;
+	struct timespec now;
+	unsigned int i, count = 0;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+		logerr("WARNING: clock_gettime() failed: %s\n",
+		       strerror(errno));
+		return 0;
+	}
+
+	/* Collect the due timers in deadline order. */
+	for (i = 0; i < timer_heap_size; i++) {
+		timer = timer_heap[i];
+		if (timespec_after(&timer->timeout, &now))
 			continue;
-		if (err != EINTR) {
-			logerr("WARNING: clock_nanosleep() failed: %s\n",
-			       strerror(err));
-			break;
+		list_for_each_entry(pos, &expired_list, list) {
+			if (timespec_after(&pos->deadline, &timer->deadline))
+				break;
 		}
+		list_add_tail(&timer->list, &pos->list);
 	}
+	list_for_each_entry(timer, &expired_list, list)
+		heap_remove(timer);
 
-	timer_lock();
-	list_for_each_entry(timer, &timer_list, list) {
-		if (timer->id == timer_id) {
-			do_sleeptimer_dequeue(timer);
-			timer->callback(timer);
-			break;
-		}
+	while (!list_empty(&expired_list)) {
+		timer = list_first_entry(&expired_list, struct sleeptimer, list);
+		list_del_init(&timer->list);
+		timer->callback(timer);
+		count++;
+	}
+
+	return count;
+}
+
+/* Periodically log how many wakeups the coalescing saved. */
+static void sleeptimer_account_wakeup(unsigned int expirations)
+{
+	struct timespec now;
+	unsigned int saved;
+
+	if (!loglevel_is_debug())
+		return;
+	if (clock_gettime(CLOCK_MONOTONIC, &now))
+		return;
+
+	if (timer_stats.period_start.tv_sec == 0)
+		timer_stats.period_start = now;
+	timer_stats.wakeups++;
+	timer_stats.expirations += expirations;
+
+	if (now.tv_sec - timer_stats.period_start.tv_sec < 60)
+		return;
+	saved = timer_stats.expirations - min(timer_stats.wakeups,
+					      timer_stats.expirations);
+	logdebug("timer: %u wakeups/min for %u timer expirations/min "
+		 "(%u wakeups/min saved by alignment and slack)\n",
+		 timer_stats.wakeups, timer_stats.expirations, saved);
+	timer_stats.period_start = now;
+	timer_stats.wakeups = 0;
+	timer_stats.expirations = 0;
+}
+
+static void sleeptimer_expired(struct iowatch *w, uint32_t events)
+{
+	uint64_t expirations;
+	ssize_t res;
+	unsigned int count;
+
+	res = read(w->fd, &expirations, sizeof(expirations));
+	if (res != sizeof(expirations))
+		return;
+	/* The timerfd is disarmed now. */
+	memset(&timer_armed, 0, sizeof(timer_armed));
+
+	count = sleeptimer_run_expired();
+	sleeptimer_account_wakeup(count);
+	sleeptimer_rearm();
+}
+
+static unsigned int get_slack_config(const char *item, int _default)
+{
+	int slack;
+
+	slack = config_get_int(backend.config, "SYSTEM", item, _default);
+
+	return (unsigned int)clamp(slack, 0, 60 * 1000);
+}
+
+int sleeptimer_system_init(void)
+{
+	int err;
+
+	timer_slack[SLEEPTIMER_INTERACTIVE] =
+		get_slack_config("event_slack_interactive", 20);
+	timer_slack[SLEEPTIMER_BACKGROUND] =
+		get_slack_config("event_slack", 1010);
+	timer_slack[SLEEPTIMER_BULK] =
+		get_slack_config("event_slack_bulk", 5000);
+	timer_grid = (unsigned int)clamp(config_get_int(backend.config, "SYSTEM",
+							"wakeup_grid", 2000),
+					 0, 60 * 1000);
+	logdebug("timer: wakeup grid %u ms\n", timer_grid);
+	logdebug("timer: slack interactive=%u ms, background=%u ms, bulk=%u ms\n",
+		 timer_slack[SLEEPTIMER_INTERACTIVE],
+		 timer_slack[SLEEPTIMER_BACKGROUND],
+		 timer_slack[SLEEPTIMER_BULK]);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		logerr("Failed to create timerfd: %s\n", strerror(errno));
+		return -errno;
+	}
+	iowatch_init(&timer_watch, "timers", sleeptimer_expired);
+	err = iowatch_add(&timer_watch, timer_fd, EPOLLIN);
+	if (err) {
+		close(timer_fd);
+		timer_fd = -1;
+		return err;
 	}
-	timer_unlock();
 
 	return 0;
 }
+
+void sleeptimer_system_exit(void)
+{
+	if (timer_fd >= 0) {
+		iowatch_remove(&timer_watch);
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	free(timer_heap);
+	timer_heap = NULL;
+	timer_heap_size = 0;
+	timer_heap_allocated = 0;
+}
@@ -13,29 +13,50 @@ extern "C" {
 
 struct sleeptimer;
 
+/* How much a timer may be delayed to coalesce wakeups.
+ * The actual slack per class is configurable. */
+enum sleeptimer_latency {
+	SLEEPTIMER_INTERACTIVE,		/* User visible. Fire (almost) on time. */
+	SLEEPTIMER_BACKGROUND,		/* Short polling. */
+	SLEEPTIMER_BULK,		/* Slow polling. May be deferred a lot. */
+	NR_SLEEPTIMER_LATENCIES,
+};
+
 typedef void (*sleeptimer_callback_t)(struct sleeptimer *timer);
 
-typedef uint64_t timer_id_t;
+static inline int timespec_after(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec > b->tv_sec;
+	return a->tv_nsec > b->tv_nsec;
+}
 
 struct sleeptimer {
 	const char *name;
 	struct timespec timeout;
+	enum sleeptimer_latency latency;
 	sleeptimer_callback_t callback;
-	timer_id_t id;
+
+	/* Internal */
+	struct timespec deadline;
+	int heap_index;
 	struct list_head list;
 };
 
 void sleeptimer_init(struct sleeptimer *timer,
 		     const char *name,
+		     enum sleeptimer_latency latency,
 		     sleeptimer_callback_t callback);
 void sleeptimer_set_timeout_relative(struct sleeptimer *timer,
 				     unsigned int msecs);
+void sleeptimer_set_timeout_aligned(struct sleeptimer *timer,
+				    unsigned int msecs);
 
 void sleeptimer_enqueue(struct sleeptimer *timer);
 void sleeptimer_dequeue(struct sleeptimer *timer);
 
 int sleeptimer_system_init(void);
-int sleeptimer_wait_next(void);
+void sleeptimer_system_exit(void);
 
 
 #ifdef __cplusplus
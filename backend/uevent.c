@@ -0,0 +1,364 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+#include "uevent.h"
+#include "eventloop.h"
+#include "util.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/filter.h>
+
+
+/* Kernel uevents are at most 2048 bytes. */
+#define UEVENT_MSG_SIZE		4096
+#define UEVENT_RCVBUF		(256 * 1024)
+#define UEVENT_GROUP_KERNEL	1
+/* Number of message offsets searched for the SUBSYSTEM variable
+ * by the socket filter. The kernel puts it behind the header, ACTION
+ * and DEVPATH. Messages with a later SUBSYSTEM variable are dropped. */
+#define UEVENT_FILTER_SCAN	512
+#define UEVENT_FILTER_MAX	(UEVENT_FILTER_SCAN * 4 + 256)
+
+static int uevent_fd = -1;
+static struct iowatch uevent_watch;
+static LIST_HEAD(uevent_listeners);
+
+
+void uevent_iter_init(struct uevent_iter *it, const char *buf, size_t len)
+{
+	it->pos = buf;
+	it->end = buf + len;
+}
+
+static int uevent_is_sep(char c)
+{
+	return c == '\n' || c == '\0';
+}
+
+/* Get the next KEY=VALUE variable.
+ * Returns 1 if a variable was found or 0 at the end of the buffer.
+ * Lines without '=' are skipped. */
+int uevent_next(struct uevent_iter *it, struct uevent_var *var)
+{
+	const char *line, *line_end, *eq;
+
+	while (it->pos < it->end) {
+		line = it->pos;
+		eq = NULL;
+		while (it->pos < it->end && !uevent_is_sep(*it->pos)) {
+			if (!eq && *it->pos == '=')
+				eq = it->pos;
+			it->pos++;
+		}
+		line_end = it->pos;
+		if (it->pos < it->end)
+			it->pos++;
+		if (!eq || eq == line)
+			continue;
+
+		var->key = line;
+		var->key_len = eq - line;
+		var->value = eq + 1;
+		var->value_len = line_end - var->value;
+		return 1;
+	}
+
+	return 0;
+}
+
+int uevent_key_is(const struct uevent_var *var, const char *key)
+{
+	size_t len = strlen(key);
+
+	return var->key_len == len && memcmp(var->key, key, len) == 0;
+}
+
+int uevent_value_is(const struct uevent_var *var, const char *value)
+{
+	size_t len = strlen(value);
+
+	return var->value_len == len && memcmp(var->value, value, len) == 0;
+}
+
+int uevent_value_int(const struct uevent_var *var, int *value)
+{
+	return parse_int(var->value, var->value_len, 10, value);
+}
+
+void uevent_listener_init(struct uevent_listener *l,
+			  const char *subsystem,
+			  uevent_callback_t callback)
+{
+	l->subsystem = subsystem;
+	l->callback = callback;
+	INIT_LIST_HEAD(&l->list);
+}
+
+/* Get the bytes in network byte order, as loaded by the socket filter. */
+static uint32_t filter_bytes(const char *p, unsigned int size)
+{
+	uint32_t value = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; i++)
+		value = (value << 8) | (uint8_t)p[i];
+
+	return value;
+}
+
+/* Build a classic BPF program, that only passes the messages with the
+ * SUBSYSTEM variable of a registered listener. There are no loops in
+ * classic BPF, so the search for the variable is unrolled. A load beyond
+ * the end of the message drops it.
+ * Returns the number of instructions or 0, if the filter does not fit. */
+static unsigned int uevent_build_filter(struct sock_filter *prog)
+{
+	struct uevent_listener *l;
+	char pattern[64];
+	unsigned int n = 0, k, i, size, len, nr_cmp, next;
+
+	if (list_empty(&uevent_listeners)) {
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+		return n;
+	}
+
+	/* Find the start of the variable. The NUL of the preceding one
+	 * keeps a "SUB" inside of the DEVPATH from matching.
+	 * Continue at the comparison with X = offset. */
+	for (k = 0; k < UEVENT_FILTER_SCAN; k++) {
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, k);
+		prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+							 filter_bytes("\0SUB", 4), 0, 2);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, k);
+		prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JA,
+							 (UEVENT_FILTER_SCAN - k) * 4 - 3,
+							 0, 0);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	/* Compare the rest of the variable with each subsystem. */
+	list_for_each_entry(l, &uevent_listeners, list) {
+		len = snprintf(pattern, sizeof(pattern), "SYSTEM=%s", l->subsystem);
+		if (len >= sizeof(pattern) - 1)
+			return 0;
+		len++;	/* Including the terminating NUL */
+		nr_cmp = len / 4 + !!(len & 2) + (len & 1);
+		next = n + nr_cmp * 2 + 1;
+		if (next + 1 > UEVENT_FILTER_MAX)
+			return 0;
+		for (i = 0; i < len; i += size) {
+			size = (len - i >= 4) ? 4 : ((len - i >= 2) ? 2 : 1);
+			prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_IND |
+				(size == 4 ? BPF_W : (size == 2 ? BPF_H : BPF_B)),
+				4 + i);
+			prog[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+							       filter_bytes(pattern + i, size),
+							       0, next - (n + 1));
+			n++;
+		}
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF);
+	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	return n;
+}
+
+/* Let the kernel drop the uevents nobody listens to,
+ * so that they do not wake us up. */
+static void uevent_update_filter(void)
+{
+	static struct sock_filter prog[UEVENT_FILTER_MAX];
+	struct sock_fprog fprog = {
+		.filter	= prog,
+	};
+	int dummy = 0;
+
+	/* Replacing the filter would charge the old and the new program
+	 * to the socket at the same time. Detach the old one first. */
+	setsockopt(uevent_fd, SOL_SOCKET, SO_DETACH_FILTER,
+		   &dummy, sizeof(dummy));
+	fprog.len = uevent_build_filter(prog);
+	if (!fprog.len ||
+	    setsockopt(uevent_fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		       &fprog, sizeof(fprog))) {
+		logerr("uevent: Failed to attach the socket filter. "
+		       "Receiving all uevents.\n");
+	}
+}
+
+/* Returns -ENODEV, if the uevent monitor is not available. */
+int uevent_listener_register(struct uevent_listener *l)
+{
+	if (uevent_fd < 0)
+		return -ENODEV;
+	list_del_init(&l->list);
+	list_add_tail(&l->list, &uevent_listeners);
+	uevent_update_filter();
+
+	return 0;
+}
+
+void uevent_listener_unregister(struct uevent_listener *l)
+{
+	if (list_empty(&l->list))
+		return;
+	list_del_init(&l->list);
+	if (uevent_fd >= 0)
+		uevent_update_filter();
+}
+
+static void uevent_dispatch(const char *subsystem, const struct uevent_msg *msg)
+{
+	struct uevent_listener *l, *l_tmp;
+
+	list_for_each_entry_safe(l, l_tmp, &uevent_listeners, list) {
+		if (subsystem && strcmp(l->subsystem, subsystem) != 0)
+			continue;
+		l->callback(l, msg);
+	}
+}
+
+static void uevent_handle_msg(char *buf, size_t len)
+{
+	struct uevent_msg msg = { 0, };
+	const char *subsystem = NULL;
+	struct uevent_iter it;
+	struct uevent_var var;
+	size_t header_len;
+
+	/* The message starts with "action@devpath" followed by the
+	 * NUL separated variables. */
+	buf[len] = '\0';
+	header_len = strlen(buf) + 1;
+	if (!strchr(buf, '@') || header_len >= len)
+		return;
+	msg.vars = buf + header_len;
+	msg.vars_len = len - header_len;
+
+	uevent_iter_init(&it, msg.vars, msg.vars_len);
+	uevent_for_each_var(&var, &it) {
+		/* The variables are NUL terminated in the buffer. */
+		if (uevent_key_is(&var, "ACTION"))
+			msg.action = var.value;
+		else if (uevent_key_is(&var, "DEVPATH"))
+			msg.devpath = var.value;
+		else if (uevent_key_is(&var, "SUBSYSTEM"))
+			subsystem = var.value;
+	}
+	if (!msg.action || !msg.devpath || !subsystem)
+		return;
+
+	logdebug("uevent: %s %s (%s)\n", msg.action, msg.devpath, subsystem);
+	uevent_dispatch(subsystem, &msg);
+}
+
+static void uevent_event(struct iowatch *w, uint32_t events)
+{
+	static const struct uevent_msg lost_msg = { 0, };
+	char buf[UEVENT_MSG_SIZE + 1];
+	struct sockaddr_nl addr;
+	struct iovec iov = {
+		.iov_base	= buf,
+		.iov_len	= UEVENT_MSG_SIZE,
+	};
+	struct msghdr mh = {
+		.msg_name	= &addr,
+		.msg_namelen	= sizeof(addr),
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	ssize_t count;
+
+	while (1) {
+		mh.msg_namelen = sizeof(addr);
+		count = recvmsg(uevent_fd, &mh, 0);
+		if (count < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS) {
+				/* The socket buffer overflowed.
+				 * Let all listeners resync their state. */
+				logdebug("uevent: Events lost\n");
+				uevent_dispatch(NULL, &lost_msg);
+				continue;
+			}
+			if (errno != EAGAIN)
+				logerr("uevent: Receive failed: %s\n", strerror(errno));
+			break;
+		}
+		/* Only accept events from the kernel. */
+		if (mh.msg_namelen != sizeof(addr) || addr.nl_pid != 0)
+			continue;
+		if (mh.msg_flags & MSG_TRUNC)
+			continue;
+		uevent_handle_msg(buf, count);
+	}
+}
+
+int uevent_monitor_init(void)
+{
+	struct sockaddr_nl addr = {
+		.nl_family	= AF_NETLINK,
+		.nl_groups	= UEVENT_GROUP_KERNEL,
+	};
+	int rcvbuf = UEVENT_RCVBUF;
+	int err;
+
+	uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			   NETLINK_KOBJECT_UEVENT);
+	if (uevent_fd < 0) {
+		err = -errno;
+		goto error;
+	}
+	setsockopt(uevent_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	/* Nobody listens, yet. */
+	uevent_update_filter();
+	if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		err = -errno;
+		goto err_close;
+	}
+	iowatch_init(&uevent_watch, "uevent", uevent_event);
+	err = iowatch_add(&uevent_watch, uevent_fd, EPOLLIN);
+	if (err)
+		goto err_close;
+
+	return 0;
+
+err_close:
+	close(uevent_fd);
+	uevent_fd = -1;
+error:
+	logerr("uevent: Failed to create the monitor: %s. "
+	       "Falling back to polling.\n", strerror(-err));
+	return err;
+}
+
+void uevent_monitor_exit(void)
+{
+	struct uevent_listener *l, *l_tmp;
+
+	if (uevent_fd < 0)
+		return;
+	list_for_each_entry_safe(l, l_tmp, &uevent_listeners, list)
+		list_del_init(&l->list);
+	iowatch_remove(&uevent_watch);
+	close(uevent_fd);
+	uevent_fd = -1;
+}
@@ -0,0 +1,70 @@
+#ifndef BACKEND_UEVENT_H_
+#define BACKEND_UEVENT_H_
+
+#include "list.h"
+
+#include <stddef.h>
+
+
+/* One KEY=VALUE variable of a uevent.
+ * The strings point into the parsed buffer and are not NUL terminated. */
+struct uevent_var {
+	const char *key;
+	size_t key_len;
+	const char *value;
+	size_t value_len;
+};
+
+/* Iterator over the variables of a uevent buffer.
+ * Variables are separated by newlines (sysfs uevent attribute)
+ * or by NUL characters (netlink uevent message). */
+struct uevent_iter {
+	const char *pos;
+	const char *end;
+};
+
+void uevent_iter_init(struct uevent_iter *it, const char *buf, size_t len);
+int uevent_next(struct uevent_iter *it, struct uevent_var *var);
+
+int uevent_key_is(const struct uevent_var *var, const char *key);
+int uevent_value_is(const struct uevent_var *var, const char *value);
+int uevent_value_int(const struct uevent_var *var, int *value);
+
+#define uevent_for_each_var(var, it)	while (uevent_next(it, var))
+
+/* A kernel uevent received from the netlink socket. */
+struct uevent_msg {
+	const char *action;	/* "add", "change", ... NULL if events were lost. */
+	const char *devpath;
+	const char *vars;	/* NUL separated KEY=VALUE variables */
+	size_t vars_len;
+};
+
+struct uevent_listener;
+
+typedef void (*uevent_callback_t)(struct uevent_listener *l,
+				  const struct uevent_msg *msg);
+
+struct uevent_listener {
+	const char *subsystem;
+	uevent_callback_t callback;
+
+	/* Internal */
+	struct list_head list;
+};
+
+void uevent_listener_init(struct uevent_listener *l,
+			  const char *subsystem,
+			  uevent_callback_t callback);
+int uevent_listener_register(struct uevent_listener *l);
+void uevent_listener_unregister(struct uevent_listener *l);
+
+static inline int uevent_listener_active(const struct uevent_listener *l)
+{
+	return !list_empty(&l->list);
+}
+
+int uevent_monitor_init(void);
+void uevent_monitor_exit(void);
+
+#endif /* BACKEND_UEVENT_H_ */
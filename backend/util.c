@@ -22,6 +22,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 
 
 void msleep(unsigned int msecs)
@@ -80,6 +82,55 @@ char * string_split(char *str, int (*sep_match)(int c))
 	return NULL;
 }
 
+/* Parse an integer like strtol(), but without the locale overhead.
+ * The number may be followed by a newline. */
+int parse_int(const char *str, size_t len, int base, int *value)
+{
+	const char *end = str + len;
+	long long val = 0;
+	unsigned int digit, count = 0;
+	int neg = 0;
+	char c;
+
+	while (str < end && (*str == ' ' || *str == '\t'))
+		str++;
+	if (str < end && (*str == '-' || *str == '+')) {
+		neg = (*str == '-');
+		str++;
+	}
+	if ((base == 0 || base == 16) && end - str >= 2 &&
+	    str[0] == '0' && (str[1] | 0x20) == 'x') {
+		base = 16;
+		str += 2;
+	} else if (base == 0) {
+		base = (str < end && str[0] == '0') ? 8 : 10;
+	}
+
+	for ( ; str < end; str++, count++) {
+		c = *str;
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+			digit = (c | 0x20) - 'a' + 10;
+		else
+			break;
+		if (digit >= (unsigned int)base)
+			break;
+		val = val * base + digit;
+		if (val > (long long)INT_MAX + 1)
+			return -EINVAL;
+	}
+	if (!count || (str < end && *str != '\n'))
+		return -EINVAL;
+	if (neg)
+		val = -val;
+	if (val > INT_MAX)
+		return -EINVAL;
+	*value = val;
+
+	return 0;
+}
+
 uint_fast8_t tiny_hash(const char *str)
 {
 	uint8_t c, hash = 21;
@@ -98,6 +149,7 @@ pid_t subprocess_exec(const char *_command)
 	unsigned int i;
 	long err = 0;
 	pid_t pid;
+	sigset_t sigset;
 
 	if (strlen(_command) >= sizeof(command_buf) - 1) {
 		logerr("subprocess_exec: Command too long");
@@ -136,6 +188,11 @@ pid_t subprocess_exec(const char *_command)
 		goto out;
 	}
 	if (pid == 0) { /* Child */
+		/* The daemon blocks the signals it receives via signalfd.
+		 * Don't leak that mask into the helper. */
+		sigemptyset(&sigset);
+		sigprocmask(SIG_SETMASK, &sigset, NULL);
+		signal(SIGPIPE, SIG_DFL);
 		execv(argv[0], argv);
 		logerr("subprocess_exec: Failed to exec '%s': %s\n",
 		       _command, strerror(errno));
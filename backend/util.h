@@ -50,6 +50,7 @@
 void msleep(unsigned int msecs);
 char * string_strip(char *str);
 char * string_split(char *str, int (*sep_match)(int c));
+int parse_int(const char *str, size_t len, int base, int *value);
 
 static inline void * zalloc(size_t size)
 {
@@ -74,8 +74,6 @@ void unblock_x11_input(struct x11lock *xl)
 	if (!pid)
 		return;
 
-	block_signals();
-
 	xl->killed = 1;
 	err = kill(pid, SIGTERM);
 	if (err) {
@@ -83,8 +81,6 @@ void unblock_x11_input(struct x11lock *xl)
 		       (int)pid);
 		return;
 	}
-
-	unblock_signals();
 }
 
 void x11lock_sigchld(struct x11lock *xl, int wait)
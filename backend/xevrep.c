@@ -92,16 +92,12 @@ void xevrep_disable(struct xevrep *xr)
 	if (!pid)
 		return;
 
-	block_signals();
-
 	xr->killed = 1;
 	err = kill(pid, SIGTERM);
 	if (err) {
 		logerr("xevrep_disable: Failed to kill helper process PID %d\n",
 		       (int)pid);
 	}
-
-	unblock_signals();
 }
 
 void xevrep_sigchld(struct xevrep *xr, int wait)
@@ -0,0 +1,502 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+/* Connection stress test for pwrtray-backend.
+ * Opens many client connections at once, sends a PING on each
+ * and waits for all replies.
+ * With --stall, a client subscribes to notifications and stops reading,
+ * while other clients change the backlight brightness. The stalled client
+ * must stay connected and finally receive the latest state. */
+
+#include "api.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#define PFX		"pwrtray-stress: "
+#define TIMEOUT_MS	10000
+#define MAX_RECORDS	(PT_FRAME_MAX_SIZE / sizeof(struct pt_record))
+#define NR_CONTROL	8
+
+
+struct conn {
+	int fd;
+	size_t rxpos;
+	union {
+		struct pt_message msg;
+		uint8_t frame[PT_FRAME_MAX_SIZE];
+	} rx;
+};
+
+static unsigned int version;
+
+
+static int msec_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static int conn_open(struct conn *c)
+{
+	struct sockaddr_un addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, version >= 2 ? PT_SOCKET_V2 : PT_SOCKET,
+		sizeof(addr.sun_path) - 1);
+
+	c->rxpos = 0;
+	c->fd = socket(AF_UNIX, (version >= 2 ? SOCK_SEQPACKET : SOCK_STREAM) |
+		       SOCK_CLOEXEC, 0);
+	if (c->fd < 0)
+		return -errno;
+	if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(c->fd);
+		c->fd = -1;
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int conn_send_ping(struct conn *c)
+{
+	struct pt_message msg;
+	uint8_t frame[PT_FRAME_MAX_SIZE];
+	size_t size;
+	ssize_t res;
+
+	memset(&msg, 0, sizeof(msg));
+	if (version >= 2) {
+		msg.id = htons(PTREQ_HELLO);
+		msg.hello.version = htonl(2);
+		size = pt_frame_put(frame, 0, &msg, 0);
+		msg.id = htons(PTREQ_PING);
+		size = pt_frame_put(frame, size, &msg, 1);
+		res = send(c->fd, frame, size, MSG_NOSIGNAL);
+	} else {
+		msg.id = htons(PTREQ_PING);
+		size = sizeof(msg);
+		res = send(c->fd, &msg, size, MSG_NOSIGNAL);
+	}
+	if (res < 0)
+		return -errno;
+	if ((size_t)res != size)
+		return -EIO;
+
+	return 0;
+}
+
+/* Send one message. On protocol v2 in a frame of its own. */
+static int conn_send(struct conn *c, const struct pt_message *msg,
+		     uint16_t tag)
+{
+	uint8_t frame[PT_FRAME_MAX_SIZE];
+	size_t size;
+	ssize_t res;
+
+	if (version >= 2) {
+		size = pt_frame_put(frame, 0, msg, tag);
+		res = send(c->fd, frame, size, MSG_NOSIGNAL);
+	} else {
+		size = sizeof(*msg);
+		res = send(c->fd, msg, size, MSG_NOSIGNAL);
+	}
+	if (res < 0)
+		return -errno;
+	if ((size_t)res != size)
+		return -EIO;
+
+	return 0;
+}
+
+/* Receive one v1 message or v2 frame without blocking.
+ * Returns the number of received messages (0 for a partial v1 message)
+ * or a negative error code. */
+static int conn_read(struct conn *c, struct pt_message *msgs,
+		     uint16_t *tags, unsigned int max)
+{
+	unsigned int count = 0;
+	size_t offset;
+	ssize_t res;
+
+	if (version >= 2) {
+		res = recv(c->fd, c->rx.frame, sizeof(c->rx.frame),
+			   MSG_DONTWAIT);
+		if (res < 0)
+			return -errno;
+		if (res == 0)
+			return -EIO;
+		offset = 0;
+		while (offset < (size_t)res && count < max) {
+			offset = pt_frame_get(c->rx.frame, res, offset,
+					      &msgs[count], &tags[count]);
+			if (!offset)
+				return -EIO;
+			count++;
+		}
+		return count;
+	}
+
+	res = recv(c->fd, (uint8_t *)&c->rx.msg + c->rxpos,
+		   sizeof(c->rx.msg) - c->rxpos, MSG_DONTWAIT);
+	if (res < 0)
+		return -errno;
+	if (res == 0)
+		return -EIO;
+	c->rxpos += res;
+	if (c->rxpos < sizeof(c->rx.msg))
+		return 0;
+	c->rxpos = 0;
+	msgs[0] = c->rx.msg;
+	tags[0] = 0;
+
+	return 1;
+}
+
+/* Returns 1, if the PING reply was received. */
+static int conn_recv(struct conn *c)
+{
+	struct pt_message msgs[MAX_RECORDS];
+	uint16_t tags[MAX_RECORDS];
+	int i, count;
+
+	count = conn_read(c, msgs, tags, MAX_RECORDS);
+	if (count == -EAGAIN)
+		return 0;
+	if (count < 0)
+		return -EIO;
+	for (i = 0; i < count; i++) {
+		if (ntohs(msgs[i].id) == PTREQ_PING &&
+		    (msgs[i].flags & htons(PT_FLG_REPLY)) &&
+		    (version < 2 || tags[i] == 1))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Send a request and wait for its reply, which is returned in msg.
+ * Other messages are discarded. */
+static int conn_request(struct conn *c, struct pt_message *msg)
+{
+	struct pt_message msgs[MAX_RECORDS];
+	uint16_t tags[MAX_RECORDS];
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN, };
+	uint16_t id = msg->id;
+	int i, res;
+
+	res = conn_send(c, msg, 1);
+	if (res)
+		return res;
+	while (1) {
+		res = poll(&pfd, 1, TIMEOUT_MS);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return -ETIMEDOUT;
+		res = conn_read(c, msgs, tags, MAX_RECORDS);
+		if (res == -EAGAIN)
+			continue;
+		if (res < 0)
+			return res;
+		for (i = 0; i < res; i++) {
+			if (msgs[i].id != id ||
+			    !(msgs[i].flags & htons(PT_FLG_REPLY)))
+				continue;
+			*msg = msgs[i];
+			return (msg->flags & htons(PT_FLG_OK)) ? 0 : -EIO;
+		}
+	}
+}
+
+/* Connect and negotiate the protocol version. */
+static int conn_setup(struct conn *c)
+{
+	struct pt_message msg;
+	int err;
+
+	err = conn_open(c);
+	if (err || version < 2)
+		return err;
+	memset(&msg, 0, sizeof(msg));
+	msg.id = htons(PTREQ_HELLO);
+	msg.hello.version = htonl(2);
+
+	return conn_request(c, &msg);
+}
+
+static int connection_test(unsigned int nr_conns)
+{
+	unsigned int i, nr_open = 0, nr_ok = 0, nr_failed = 0;
+	unsigned int pending;
+	struct conn *conns;
+	struct pollfd *pfds;
+	struct timespec start;
+	struct rlimit rlim;
+	int res, connect_ms;
+
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < nr_conns + 16) {
+		rlim.rlim_cur = nr_conns + 16;
+		if (rlim.rlim_cur > rlim.rlim_max)
+			rlim.rlim_cur = rlim.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rlim);
+	}
+
+	conns = calloc(nr_conns, sizeof(*conns));
+	pfds = calloc(nr_conns, sizeof(*pfds));
+	if (!conns || !pfds) {
+		fprintf(stderr, PFX "Out of memory\n");
+		return 1;
+	}
+
+	/* Connect all clients at once. */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_conns; i++) {
+		res = conn_open(&conns[i]);
+		if (res) {
+			fprintf(stderr, PFX "Connection %u failed: %s\n",
+				i, strerror(-res));
+			break;
+		}
+		nr_open++;
+	}
+	connect_ms = msec_since(&start);
+
+	for (i = 0; i < nr_open; i++) {
+		pfds[i].fd = conns[i].fd;
+		pfds[i].events = POLLIN;
+		if (conn_send_ping(&conns[i])) {
+			pfds[i].fd = -1;
+			nr_failed++;
+		}
+	}
+
+	/* Wait for all replies. */
+	pending = nr_open - nr_failed;
+	while (pending && msec_since(&start) < TIMEOUT_MS) {
+		res = poll(pfds, nr_open, 100);
+		if (res < 0 && errno != EINTR)
+			break;
+		for (i = 0; res > 0 && i < nr_open; i++) {
+			if (pfds[i].fd < 0 || !pfds[i].revents)
+				continue;
+			res--;
+			switch (conn_recv(&conns[i])) {
+			case 0:
+				continue;
+			case 1:
+				nr_ok++;
+				break;
+			default:
+				nr_failed++;
+				break;
+			}
+			pfds[i].fd = -1;
+			pending--;
+		}
+	}
+
+	printf("%u connections (protocol v%u) opened in %d ms\n",
+	       nr_open, version >= 2 ? 2 : 1, connect_ms);
+	printf("%u replies, %u failed, %u timed out, total %d ms\n",
+	       nr_ok, nr_failed, pending, msec_since(&start));
+
+	for (i = 0; i < nr_open; i++)
+		close(conns[i].fd);
+	free(pfds);
+	free(conns);
+
+	return (nr_ok == nr_conns) ? 0 : 1;
+}
+
+/* Receive everything queued for the stalled client, until it is idle.
+ * Returns a negative error code, if the connection was closed. */
+static int stall_drain(struct conn *c, unsigned int *nr_bl,
+		       unsigned int *nr_bat, int32_t *last_bl)
+{
+	struct pt_message msgs[MAX_RECORDS];
+	uint16_t tags[MAX_RECORDS];
+	struct pollfd pfd = { .fd = c->fd, .events = POLLIN, };
+	int i, res;
+
+	while (1) {
+		res = poll(&pfd, 1, 500);
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res <= 0)
+			return 0;
+		res = conn_read(c, msgs, tags, MAX_RECORDS);
+		if (res == -EAGAIN)
+			continue;
+		if (res < 0)
+			return res;
+		for (i = 0; i < res; i++) {
+			switch (ntohs(msgs[i].id)) {
+			case PTNOTI_BL_CHANGED:
+				(*nr_bl)++;
+				*last_bl = ntohl(msgs[i].bl_stat.brightness);
+				break;
+			case PTNOTI_BAT_CHANGED:
+				(*nr_bat)++;
+				break;
+			}
+		}
+	}
+}
+
+static int stall_test(unsigned int nr_changes)
+{
+	struct conn stalled, control[NR_CONTROL];
+	struct pt_message msg;
+	unsigned int i, tries, nr_bl = 0, nr_bat = 0;
+	int32_t min, max, value = 0, last_bl = -1;
+	int res, disconnected = 0, ret = 1;
+
+	memset(&stalled, 0, sizeof(stalled));
+	memset(control, 0, sizeof(control));
+	stalled.fd = -1;
+	for (i = 0; i < NR_CONTROL; i++)
+		control[i].fd = -1;
+
+	/* Subscribe to all notifications and stop reading. */
+	res = conn_setup(&stalled);
+	if (!res) {
+		memset(&msg, 0, sizeof(msg));
+		msg.id = htons(PTREQ_WANT_NOTIFY);
+		msg.flags = htons(PT_FLG_ENABLE);
+		res = conn_request(&stalled, &msg);
+	}
+	for (i = 0; !res && i < NR_CONTROL; i++)
+		res = conn_setup(&control[i]);
+	if (!res) {
+		memset(&msg, 0, sizeof(msg));
+		msg.id = htons(PTREQ_BL_GETSTATE);
+		res = conn_request(&control[0], &msg);
+	}
+	if (res) {
+		fprintf(stderr, PFX "Failed to set up the clients: %s\n",
+			strerror(-res));
+		goto out;
+	}
+	min = ntohl(msg.bl_stat.min_brightness);
+	max = ntohl(msg.bl_stat.max_brightness);
+	if (max <= min) {
+		fprintf(stderr, PFX "The backlight brightness can not be changed\n");
+		goto out;
+	}
+
+	/* Toggle the brightness. The requests are spread over several
+	 * clients to stay below the request rate limit. */
+	for (i = 0; i < nr_changes; i++) {
+		value = (i & 1) ? min : max;
+		memset(&msg, 0, sizeof(msg));
+		msg.id = htons(PTREQ_BL_SETBRIGHTNESS);
+		msg.bl_set.brightness = htonl(value);
+		res = conn_request(&control[i % NR_CONTROL], &msg);
+		if (res) {
+			fprintf(stderr, PFX "Failed to set the brightness: %s\n",
+				strerror(-res));
+			goto out;
+		}
+	}
+
+	/* Drain the stalled client and compare its latest notification
+	 * with the current state. Retry, if the state changed meanwhile
+	 * (e.g. by autodim). */
+	for (tries = 0; tries < 3; tries++) {
+		res = stall_drain(&stalled, &nr_bl, &nr_bat, &last_bl);
+		if (res) {
+			disconnected = 1;
+			break;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.id = htons(PTREQ_BL_GETSTATE);
+		res = conn_request(&control[0], &msg);
+		if (res) {
+			fprintf(stderr, PFX "Failed to get the brightness: %s\n",
+				strerror(-res));
+			goto out;
+		}
+		value = ntohl(msg.bl_stat.brightness);
+		if (last_bl == value)
+			break;
+	}
+
+	printf("%u brightness changes (protocol v%u)\n",
+	       nr_changes, version >= 2 ? 2 : 1);
+	printf("stalled client: %s, %u backlight and %u battery notifications, "
+	       "latest brightness %s\n",
+	       disconnected ? "disconnected" : "connected", nr_bl, nr_bat,
+	       last_bl == value ? "received" : "missing");
+	if (!disconnected && last_bl == value)
+		ret = 0;
+out:
+	for (i = 0; i < NR_CONTROL; i++) {
+		if (control[i].fd >= 0)
+			close(control[i].fd);
+	}
+	if (stalled.fd >= 0)
+		close(stalled.fd);
+
+	return ret;
+}
+
+static void usage(void)
+{
+	printf("Usage: pwrtray-stress [NR_CONNECTIONS [PROTOCOL_VERSION]]\n");
+	printf("       pwrtray-stress --stall [NR_CHANGES [PROTOCOL_VERSION]]\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 500;
+	int stall = 0;
+
+	if (argc > 1 && strcmp(argv[1], "--stall") == 0) {
+		stall = 1;
+		count = 1000;
+		argc--;
+		argv++;
+	}
+
+	version = 1;
+	if (argc > 3) {
+		usage();
+		return 1;
+	}
+	if ((argc > 1 && sscanf(argv[1], "%u", &count) != 1) ||
+	    (argc > 2 && sscanf(argv[2], "%u", &version) != 1) ||
+	    count == 0) {
+		usage();
+		return 1;
+	}
+
+	if (stall)
+		return stall_test(count);
+
+	return connection_test(count);
+}
@@ -0,0 +1,108 @@
+/*
+ *   Copyright (C) 2026 Michael Buesch <m@bues.ch>
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either version 2
+ *   of the License, or (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ */
+
+/* Wakeup coalescing test for the backend sleeptimers.
+ * Three timers of different latency classes are due at the first wakeup
+ * and must share it. A fourth timer sits between them in deadline order,
+ * but is not due, yet. It must not run early or keep the others back. */
+
+#include "timer.h"
+#include "eventloop.h"
+#include "main.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define PFX		"pwrtray-timertest: "
+#define MAX_WAKEUPS	10
+
+
+struct backend backend;
+
+struct testtimer {
+	const char *name;
+	enum sleeptimer_latency latency;
+	unsigned int timeout;		/* msec */
+	unsigned int wakeup;		/* The wakeup it ran in, or 0 */
+	unsigned int expected_wakeup;
+	struct sleeptimer timer;
+};
+
+static struct testtimer timers[] = {
+	{ .name = "interactive", .latency = SLEEPTIMER_INTERACTIVE,
+	  .timeout = 100, .expected_wakeup = 1, },
+	{ .name = "blocker", .latency = SLEEPTIMER_INTERACTIVE,
+	  .timeout = 400, .expected_wakeup = 2, },
+	{ .name = "background", .latency = SLEEPTIMER_BACKGROUND,
+	  .timeout = 50, .expected_wakeup = 1, },
+	{ .name = "bulk", .latency = SLEEPTIMER_BULK,
+	  .timeout = 80, .expected_wakeup = 1, },
+};
+
+static unsigned int wakeup;
+static unsigned int nr_pending;
+
+
+static void timer_callback(struct sleeptimer *timer)
+{
+	struct testtimer *t = container_of(timer, struct testtimer, timer);
+
+	t->wakeup = wakeup;
+	nr_pending--;
+}
+
+int main(void)
+{
+	struct testtimer *t;
+	unsigned int i;
+	int err, ret = 0;
+
+	err = eventloop_init();
+	if (!err)
+		err = sleeptimer_system_init();
+	if (err) {
+		fprintf(stderr, PFX "Failed to initialize the timers: %s\n",
+			strerror(-err));
+		return 1;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(timers); i++) {
+		t = &timers[i];
+		sleeptimer_init(&t->timer, t->name, t->latency,
+				timer_callback);
+		sleeptimer_set_timeout_relative(&t->timer, t->timeout);
+		sleeptimer_enqueue(&t->timer);
+		nr_pending++;
+	}
+
+	while (nr_pending && wakeup < MAX_WAKEUPS) {
+		wakeup++;
+		eventloop_wait(-1);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(timers); i++) {
+		t = &timers[i];
+		printf("%-12s ran in wakeup %u (expected %u)\n",
+		       t->name, t->wakeup, t->expected_wakeup);
+		if (t->wakeup != t->expected_wakeup)
+			ret = 1;
+	}
+	printf("%s\n", ret ? "FAILED" : "OK");
+
+	sleeptimer_system_exit();
+	eventloop_exit();
+
+	return ret;
+}
@@ -26,12 +26,17 @@
 #include <iostream>
 
 #include <QApplication>
+#include <QVector>
 
 using namespace std;
 
 
 Backend::Backend()
  : fd (-1)
+ , version (0)
+ , nextTag (0)
+ , haveSnapshotBl (false)
+ , haveSnapshotBat (false)
  , notifier (NULL)
  , errcount (0)
 {
@@ -53,86 +58,211 @@ Backend::~Backend()
 	}
 }
 
-int Backend::connectToBackend()
+int Backend::connectSocket(int type, const char *path)
 {
 	struct sockaddr_un sockaddr;
 	int err;
-	struct pt_message msg;
-
-	if (fd >= 0)
-		return 0;
 
-	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	fd = socket(AF_UNIX, type, 0);
 	if (fd == -1) {
 		cerr << "Failed to create backend socket: "
 		     << strerror(errno) << endl;
-		goto error;
+		return -1;
 	}
 	sockaddr.sun_family = AF_UNIX;
-	strncpy(sockaddr.sun_path, PT_SOCKET, sizeof(sockaddr.sun_path) - 1);
+	strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
 	err = ::connect(fd, (struct sockaddr *)&sockaddr, SUN_LEN(&sockaddr));
+	if (err) {
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Negotiate protocol v2, enable notifications and X11 input event
+ * notifications and fetch a snapshot of the state in one round-trip. */
+int Backend::setupSession()
+{
+	struct pt_message msgs[2];
+	QList<BackendMessage> snapshot;
+	QList<BackendMessage>::iterator it;
+	int err;
+
+	::memset(msgs, 0, sizeof(msgs));
+	msgs[0].id = htons(PTREQ_HELLO);
+	msgs[0].hello.version = htonl(PT_PROTOCOL_VERSION);
+	msgs[1].id = htons(PTREQ_SESSION);
+	msgs[1].session.flags = htonl(PT_SESSION_FLG_NOTIFY |
+				      PT_SESSION_FLG_XEVREP);
+
+	err = sendMessagesSyncReply(msgs, 2, &snapshot);
+	if (err && err != -ETXTBSY) {
+		cerr << "Failed to communicate with backend" << endl;
+		return -1;
+	}
+	if (!(msgs[0].flags & htons(PT_FLG_OK))) {
+		cerr << "Failed to handshake with backend" << endl;
+		return -1;
+	}
+	version = ntohl(msgs[0].hello.version);
+	if (!(msgs[1].flags & htons(PT_FLG_OK)))
+		cerr << "Failed to enable X11 input event notifications" << endl;
+
+	for (it = snapshot.begin(); it != snapshot.end(); ++it) {
+		if (!((*it).msg.flags & htons(PT_FLG_OK)))
+			continue;
+		switch (ntohs((*it).msg.id)) {
+		case PTREQ_BL_GETSTATE:
+			snapshotBl = (*it).msg;
+			haveSnapshotBl = true;
+			break;
+		case PTREQ_BAT_GETSTATE:
+			snapshotBat = (*it).msg;
+			haveSnapshotBat = true;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+int Backend::connectToBackend()
+{
+	int err;
+	struct pt_message msgs[3];
+
+	if (fd >= 0)
+		return 0;
+
+	err = connectSocket(SOCK_SEQPACKET, PT_SOCKET_V2);
+	if (!err) {
+		version = 2;
+		err = setupSession();
+		if (err)
+			goto err_close;
+		goto connected;
+	}
+
+	/* Old backend. Fall back to protocol v1. */
+	err = connectSocket(SOCK_STREAM, PT_SOCKET);
 	if (err) {
 		cerr << "Failed to connect to backend socket: "
 		     << strerror(errno) << endl;
+		goto error;
+	}
+	version = 1;
+
+	::memset(msgs, 0, sizeof(msgs));
+	msgs[0].id = htons(PTREQ_PING);
+	msgs[1].id = htons(PTREQ_WANT_NOTIFY);
+	msgs[1].flags = htons(PT_FLG_ENABLE);
+	msgs[2].id = htons(PTREQ_XEVREP);
+	msgs[2].flags = htons(PT_FLG_ENABLE);
+
+	err = sendMessagesSyncReply(msgs, 3);
+	if (err && err != -ETXTBSY) {
+		cerr << "Failed to communicate with backend" << endl;
 		goto err_close;
 	}
-
-	::memset(&msg, 0, sizeof(msg));
-	msg.id = htons(PTREQ_PING);
-	err = sendMessageSyncReply(&msg);
-	if (err) {
-		cerr << "Failed to send ping to backend" << endl;
+	if (!(msgs[0].flags & htons(PT_FLG_OK))) {
+		cerr << "Failed to handshake with backend" << endl;
 		goto err_close;
 	}
+	if (!(msgs[1].flags & htons(PT_FLG_OK))) {
+		cerr << "Failed to enable backend notifications" << endl;
+		goto err_close;
+	}
+	if (!(msgs[2].flags & htons(PT_FLG_OK)))
+		cerr << "Failed to enable X11 input event notifications" << endl;
 
-	cout << "Connected to backend" << endl;
+connected:
+	cout << "Connected to backend (protocol v" << version << ")" << endl;
 
 	notifier = new QSocketNotifier(fd, QSocketNotifier::Read, this);
 	connect(notifier, SIGNAL(activated(int)),
 		this, SLOT(readNotification(int)));
 
-	::memset(&msg, 0, sizeof(msg));
-	msg.id = htons(PTREQ_WANT_NOTIFY);
-	msg.flags = htons(PT_FLG_ENABLE);
-	err = sendMessageSyncReply(&msg);
-	if (err) {
-		cerr << "Failed to enable backend notifications" << endl;
-		goto err_free_noti;
-	}
-
-	::memset(&msg, 0, sizeof(msg));
-	msg.id = htons(PTREQ_XEVREP);
-	msg.flags = htons(PT_FLG_ENABLE);
-	err = sendMessageSyncReply(&msg);
-	if (err)
-		cerr << "Failed to enable X11 input event notifications" << endl;
-
 	return 0;
 
-err_free_noti:
-	delete notifier;
-	notifier = NULL;
 err_close:
 	close(fd);
 	fd = -1;
+	rxqueue.clear();
+	haveSnapshotBl = false;
+	haveSnapshotBat = false;
 error:
 	return -1;
 }
 
-int Backend::sendMessage(struct pt_message *msg)
+/* Get the backlight state snapshot of the session setup.
+ * The snapshot can only be taken once. Later calls return false.
+ * Returns false, if the backend failed to report the state. */
+bool Backend::takeBacklightSnapshot(struct pt_message *msg)
+{
+	if (!haveSnapshotBl)
+		return false;
+	haveSnapshotBl = false;
+	*msg = snapshotBl;
+
+	return true;
+}
+
+/* Get the battery state snapshot of the session setup.
+ * Same rules as for the backlight snapshot. */
+bool Backend::takeBatterySnapshot(struct pt_message *msg)
 {
+	if (!haveSnapshotBat)
+		return false;
+	haveSnapshotBat = false;
+	*msg = snapshotBat;
+
+	return true;
+}
+
+uint16_t Backend::allocTag()
+{
+	nextTag++;
+	if (nextTag == 0)
+		nextTag++;
+
+	return nextTag;
+}
+
+int Backend::sendMessages(struct pt_message *msgs, const uint16_t *tags, int count)
+{
+	uint8_t frame[PT_FRAME_MAX_SIZE];
+	size_t size = 0, pos;
 	ssize_t ret;
-	size_t count, pos = 0;
-
-	msg->flags |= htons(PT_FLG_OK);
-	count = sizeof(*msg);
-	while (count) {
-		ret = ::send(fd, reinterpret_cast<uint8_t *>(msg) + pos,
-			     count, 0);
-		if (ret < 0)
+	int i;
+
+	for (i = 0; i < count; i++)
+		msgs[i].flags |= htons(PT_FLG_OK);
+
+	if (version >= 2) {
+		for (i = 0; i < count; i++) {
+			size = pt_frame_put(frame, size, &msgs[i], tags[i]);
+			if (!size)
+				return -1;
+		}
+		ret = ::send(fd, frame, size, 0);
+		if (ret != (ssize_t)size)
 			return -1;
-		count -= ret;
-		pos += ret;
+		return 0;
+	}
+
+	for (i = 0; i < count; i++) {
+		size = sizeof(msgs[i]);
+		pos = 0;
+		while (size) {
+			ret = ::send(fd, reinterpret_cast<uint8_t *>(&msgs[i]) + pos,
+				     size, 0);
+			if (ret < 0)
+				return -1;
+			size -= ret;
+			pos += ret;
+		}
 	}
 
 	return 0;
@@ -140,39 +270,129 @@ int Backend::sendMessage(struct pt_message *msg)
 
 int Backend::sendMessageSyncReply(struct pt_message *msg)
 {
-	uint16_t id = msg->id;
-	int err;
-	QList<struct pt_message> msgs;
+	return sendMessagesSyncReply(msg, 1);
+}
 
-	err = sendMessage(msg);
+/* Send the messages and wait for all replies.
+ * The replies are stored in msgs. Additional replies to the
+ * requests (with a different ID) are stored in extra. */
+int Backend::sendMessagesSyncReply(struct pt_message *msgs, int count,
+				   QList<BackendMessage> *extra)
+{
+	struct BackendMessage m;
+	QVector<uint16_t> tags(count);
+	QVector<bool> replied(count);
+	int err, i, nr_replies = 0;
+	QList<BackendMessage> others;
+
+	for (i = 0; i < count; i++) {
+		tags[i] = (version >= 2) ? allocTag() : 0;
+		replied[i] = false;
+	}
+	err = sendMessages(msgs, tags.data(), count);
 	if (err)
 		return err;
-	while (1) {
-		err = recvMessage(msg);
+	while (nr_replies < count) {
+		err = recvMessage(&m.msg, &m.tag);
 		if (err)
 			return err;
-		if ((msg->id != id) || !(msg->flags & htons(PT_FLG_REPLY))) {
-			msgs.append(*msg);
+		if (!(m.msg.flags & htons(PT_FLG_REPLY)) ||
+		    pendingRequests.contains(m.tag)) {
+			others.append(m);
 			continue;
 		}
-		break;
+		/* v2 replies are matched by tag. v1 replies by ID. */
+		for (i = 0; i < count; i++) {
+			if (!replied[i] && msgs[i].id == m.msg.id &&
+			    tags[i] == m.tag) {
+				msgs[i] = m.msg;
+				replied[i] = true;
+				nr_replies++;
+				break;
+			}
+		}
+		if (i >= count && extra && version >= 2 && tags.contains(m.tag))
+			extra->append(m);
+	}
+	/* Messages that arrived in the same frame. */
+	while (!rxqueue.isEmpty())
+		others.append(rxqueue.takeFirst());
+
+	QList<BackendMessage>::iterator it;
+	for (it = others.begin(); it != others.end(); ++it)
+		processReceivedMessage(&(*it).msg, (*it).tag);
+
+	for (i = 0; i < count; i++) {
+		if (!(msgs[i].flags & htons(PT_FLG_OK)))
+			return -ETXTBSY;
 	}
 
-	QList<struct pt_message>::iterator i;
-	for (i = msgs.begin(); i != msgs.end(); ++i)
-		processReceivedMessage(&(*i));
+	return 0;
+}
+
+/* Send a request without waiting for the reply.
+ * The reply is matched by its tag, when it arrives.
+ * Protocol v1 has no tags, so wait for the reply there. */
+int Backend::sendRequest(struct pt_message *msg)
+{
+	uint16_t tag;
+	int err;
+
+	if (version < 2)
+		return sendMessageSyncReply(msg);
 
-	if (!(msg->flags & htons(PT_FLG_OK)))
-		return -ETXTBSY;
+	tag = allocTag();
+	err = sendMessages(msg, &tag, 1);
+	if (err)
+		return err;
+	pendingRequests.insert(tag, ntohs(msg->id));
 
 	return 0;
 }
 
-int Backend::recvMessage(struct pt_message *msg)
+/* Receive one v2 frame and queue its records. */
+int Backend::recvFrame()
 {
+	uint8_t frame[PT_FRAME_MAX_SIZE];
+	struct BackendMessage m;
+	size_t offset = 0;
+	ssize_t count;
+
+	count = ::recv(fd, frame, sizeof(frame), 0);
+	if (count <= 0)
+		return -1;
+	while (offset < (size_t)count) {
+		offset = pt_frame_get(frame, count, offset, &m.msg, &m.tag);
+		if (!offset)
+			return -1;
+		rxqueue.append(m);
+	}
+
+	return 0;
+}
+
+int Backend::recvMessage(struct pt_message *msg, uint16_t *tag)
+{
+	struct BackendMessage m;
 	ssize_t count;
 	size_t pos = 0;
+	int err;
+
+	if (version >= 2) {
+		while (rxqueue.isEmpty()) {
+			err = recvFrame();
+			if (err)
+				return err;
+		}
+		m = rxqueue.takeFirst();
+		*msg = m.msg;
+		if (tag)
+			*tag = m.tag;
+		return 0;
+	}
 
+	if (tag)
+		*tag = 0;
 	::memset(msg, 0, sizeof(*msg));
 	do {
 		count = ::recv(fd, reinterpret_cast<uint8_t *>(msg) + pos,
@@ -187,8 +407,20 @@ int Backend::recvMessage(struct pt_message *msg)
 	return 0;
 }
 
-void Backend::processReceivedMessage(struct pt_message *msg)
+void Backend::processReceivedMessage(struct pt_message *msg, uint16_t tag)
 {
+	if (msg->flags & htons(PT_FLG_REPLY)) {
+		/* Reply to a pipelined request. */
+		if (!pendingRequests.contains(tag)) {
+			cerr << "Received unexpected reply: " << ntohs(msg->id) << endl;
+			return;
+		}
+		pendingRequests.remove(tag);
+		if (!(msg->flags & htons(PT_FLG_OK)))
+			cerr << "Request " << ntohs(msg->id) << " failed" << endl;
+		return;
+	}
+
 	switch (ntohs(msg->id)) {
 	case PTNOTI_SRVDOWN:
 		cout << "Backend server is going down." << endl;
@@ -216,9 +448,10 @@ void Backend::checkErrorCount()
 void Backend::readNotification(int sock)
 {
 	struct pt_message msg;
+	uint16_t tag;
 	int err;
 
-	err = recvMessage(&msg);
+	err = recvMessage(&msg, &tag);
 	if (err) {
 		cerr << "Got read notification, but failed to read message" << endl;
 		errcount++;
@@ -226,7 +459,12 @@ void Backend::readNotification(int sock)
 		return;
 	}
 	errcount = 0;
-	processReceivedMessage(&msg);
+	processReceivedMessage(&msg, tag);
+	/* Process the remaining records of the frame. */
+	while (!rxqueue.isEmpty()) {
+		BackendMessage m = rxqueue.takeFirst();
+		processReceivedMessage(&m.msg, m.tag);
+	}
 }
 
 int Backend::getBatteryState(struct pt_message *msg)
@@ -259,10 +497,12 @@ int Backend::setBacklight(int value)
 	msg.id = htons(PTREQ_BL_SETBRIGHTNESS);
 	msg.bl_set.brightness = value;
 
-	return sendMessageSyncReply(&msg);
+	/* Pipeline brightness updates, e.g. while dragging the slider. */
+	return sendRequest(&msg);
 }
 
-int Backend::setBacklightAutodim(bool enable, bool enable_on_ac, int max_percent)
+int Backend::setBacklightAutodim(bool enable, bool enable_on_ac, int max_percent,
+				 bool wait)
 {
 	struct pt_message msg;
 
@@ -272,6 +512,8 @@ int Backend::setBacklightAutodim(bool enable, bool enable_on_ac, int max_percent
 	msg.bl_autodim.flags |= enable_on_ac ? htonl(PT_AUTODIM_FLG_ENABLE_AC) : 0;
 	msg.bl_autodim.max_percent = htonl(max_percent);
 
+	if (!wait)
+		return sendRequest(&msg);
 	return sendMessageSyncReply(&msg);
 }
 
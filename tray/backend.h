@@ -5,8 +5,15 @@
 
 #include <QObject>
 #include <QSocketNotifier>
+#include <QList>
+#include <QMap>
 
 
+struct BackendMessage {
+	struct pt_message msg;
+	uint16_t tag;
+};
+
 class Backend : public QObject
 {
 	Q_OBJECT
@@ -16,10 +23,13 @@ public:
 
 	int connectToBackend();
 
+	bool takeBacklightSnapshot(struct pt_message *msg);
+	bool takeBatterySnapshot(struct pt_message *msg);
 	int getBatteryState(struct pt_message *msg);
 	int getBacklightState(struct pt_message *msg);
 	int setBacklight(int value);
-	int setBacklightAutodim(bool enable, bool enable_on_ac, int max_percent);
+	int setBacklightAutodim(bool enable, bool enable_on_ac, int max_percent,
+				bool wait = true);
 
 signals:
 	void backlightStateChanged(struct pt_message *msg);
@@ -29,14 +39,29 @@ protected slots:
 	void readNotification(int sock);
 
 protected:
-	int sendMessage(struct pt_message *msg);
+	int connectSocket(int type, const char *path);
+	int setupSession();
+	uint16_t allocTag();
+	int sendMessages(struct pt_message *msgs, const uint16_t *tags, int count);
 	int sendMessageSyncReply(struct pt_message *msg);
-	int recvMessage(struct pt_message *msg);
-	void processReceivedMessage(struct pt_message *msg);
+	int sendMessagesSyncReply(struct pt_message *msgs, int count,
+				  QList<BackendMessage> *extra = NULL);
+	int sendRequest(struct pt_message *msg);
+	int recvFrame();
+	int recvMessage(struct pt_message *msg, uint16_t *tag = NULL);
+	void processReceivedMessage(struct pt_message *msg, uint16_t tag = 0);
 	void checkErrorCount();
 
 protected:
 	int fd;
+	unsigned int version;
+	QList<BackendMessage> rxqueue;
+	uint16_t nextTag;
+	QMap<uint16_t, uint16_t> pendingRequests; /* tag -> request ID */
+	bool haveSnapshotBl;
+	bool haveSnapshotBat;
+	struct pt_message snapshotBl;
+	struct pt_message snapshotBat;
 	QSocketNotifier *notifier;
 	int errcount;
 };
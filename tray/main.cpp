@@ -36,7 +36,8 @@ TrayWindow::TrayWindow(TrayIcon *_tray)
  , blockBrightnessChange (false)
  , realBrightnessMinVal (0)
 {
-	struct pt_message m;
+	Backend *backend = tray->getBackend();
+	struct pt_message m, bat;
 	int err;
 	QLabel *label;
 	QGridLayout *l = new QGridLayout(this);
@@ -59,9 +60,17 @@ TrayWindow::TrayWindow(TrayIcon *_tray)
 	battBar = new QProgressBar(this);
 	l->addWidget(battBar, 3, 1, 1, 2);
 
-	update();
-
-	err = tray->getBackend()->getBacklightState(&m);
+	/* Use the state snapshot of the session setup, if available.
+	 * Fetch the parts that are missing in the snapshot. */
+	if (backend->takeBatterySnapshot(&bat))
+		updateBattBar(&bat);
+	else
+		updateBattBar();
+	err = 0;
+	if (!backend->takeBacklightSnapshot(&m))
+		err = backend->getBacklightState(&m);
+	if (!err)
+		updateBacklightSlider(&m);
 	if (err) {
 		cerr << "Failed to fetch initial backlight state" << endl;
 	} else {
@@ -236,7 +245,8 @@ void TrayWindow::desiredBrightnessChanged(int newVal)
 		return;
 
 	if (autodim) {
-		err = tray->getBackend()->setBacklightAutodim(true, autodim_ac, newVal);
+		err = tray->getBackend()->setBacklightAutodim(true, autodim_ac,
+							      newVal, false);
 		if (err)
 			cerr << "Failed to set autodim max" << endl;
 	} else {